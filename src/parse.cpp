@@ -8,13 +8,50 @@
 #include <fstream>
 #include <algorithm>
 #include <chrono>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <climits>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#ifdef JSONPARSE_ZSTD
+#include <zstd.h>
+#endif
 
 #define ONE_INDENT "  "
+#define INPUT_BUFFER_COUNT 4
+#define INPUT_BUFFER_KIB 1024
+#define PRINT_SLICE_KIB 64// Smallest piece of output a print thread is handed
+#define SLOW_NS_PER_BYTE 20000// -differential records inputs slower than this in any mode
+#define SLOW_MIN_BYTES 64// Below this, time per byte is mostly fixed costs
+#define BASELINE_TOLERANCE_PERCENT 50// Slower than the baseline by more than this fails, see checkBaseline
+#define BASELINE_MIN_MICROSECONDS 100// Quicker modes are left out of the baseline, too short to time
+#define BASELINE_ROUNDS 5// checkModes runs per input for -baseline and -record-baseline
+#define BASELINE_RETRIES 2// Further sets of rounds before a failed baseline check counts
+#define TIMING_MIN_RUNS 10// Runs per mode for -bench and -baseline, best one counts
 
 // using namespace std::string_literals; // enables s-suffix for std::string literals
 
 const bool AllowTrailingCommas = true;
 const bool AllowSuperfluousLeadingZeroes = false;
+const int MaxNestingDepth = 1024;// Only enforced by the modes that don't build a JToken tree
 
 enum TokenKind
 {
@@ -54,21 +91,48 @@ enum JTokenKind
 
 class Token{
 public:
-    Token(TokenKind kind, std::string value){
+    Token(TokenKind kind, std::string value, size_t offset){
         Kind = kind;
         StringValue = value;
+        Offset = offset;
     }
     std::string StringValue;
     TokenKind Kind;
+    size_t Offset;// In the source it was parsed from
 };
 
 class JToken
 {
 public:
+    virtual ~JToken() {}
     virtual JTokenKind Kind() = 0;
-    virtual void Print(std::string indent) = 0;
+    virtual void Print(std::ostream &out, std::string indent) = 0;
+    // Writes the node back out as JSON. Unmodified nodes are copied verbatim
+    // from the source they were parsed from, so the original formatting
+    // survives; nodes built or changed by the mutation API are serialized.
+    // source points at the parent's Begin (the start of the document for
+    // the root).
+    virtual void Write(std::ostream &out, const char *source) = 0;
+
+    // Source span, relative to the parent's Begin so that a reparsed subtree
+    // can be spliced in without touching anything but its later siblings.
+    // For properties and array elements it includes the whitespace before
+    // them and their trailing comma.
+    size_t Begin = 0;
+    size_t End = 0;
+    bool Spanned = false;// False for nodes that were not parsed from the source
+    bool Modified = false;// Set on a changed node and all of its ancestors
+    JToken *Parent = nullptr;
 };
 
+void writeSource(std::ostream &out, const char *source, size_t begin, size_t end){
+    out.write(source + begin, end - begin);
+}
+
+void writeToken(std::ostream &out, Token *token){
+    if (token != nullptr) out << token->StringValue;
+}
+
 class JNumber : public JToken {
 public:
     JTokenKind Kind() { return JTokenKind::NumberToken; }
@@ -109,22 +173,43 @@ public:
         if (ExponentInteger != nullptr) delete ExponentInteger;
     }
     
-    void Print(std::string indent)
+    void Print(std::ostream &out, std::string indent)
     {
-        std::cout << indent;
+        out << indent;
         if (LeadingSign != nullptr)
-            std::cout << LeadingSign->StringValue;
-        std::cout << Integer->StringValue;
+            out << LeadingSign->StringValue;
+        out << Integer->StringValue;
         if (Period != nullptr)
-            std::cout << Period->StringValue
-                      << FractionalInteger->StringValue;
+            out << Period->StringValue
+                << FractionalInteger->StringValue;
         if (Exponent != nullptr) {
-            std::cout << Exponent->StringValue;
+            out << Exponent->StringValue;
             if (ExponentSign != nullptr)
-                std::cout << ExponentSign->StringValue;
-            std::cout << ExponentInteger->StringValue;
+                out << ExponentSign->StringValue;
+            out << ExponentInteger->StringValue;
+        }
+        out << '\n';
+    }
+
+    std::string Text()
+    {
+        std::string text;
+        for (auto part : {LeadingSign, Integer, Period, FractionalInteger, Exponent, ExponentSign, ExponentInteger}) {
+            if (part != nullptr) text += part->StringValue;
         }
-        std::cout << std::endl;
+        return text;
+    }
+
+    void Write(std::ostream &out, const char *source)
+    {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        writeToken(out, LeadingSign);
+        writeToken(out, Integer);
+        writeToken(out, Period);
+        writeToken(out, FractionalInteger);
+        writeToken(out, Exponent);
+        writeToken(out, ExponentSign);
+        writeToken(out, ExponentInteger);
     }
 };
 
@@ -149,13 +234,20 @@ public:
         if (RightQuote != nullptr) delete RightQuote;
     }
 
-    void Print(std::string indent) {
-        std::cout
+    void Print(std::ostream &out, std::string indent) {
+        out
             << indent
             << LeftQuote->StringValue
             << Value->StringValue
             << RightQuote->StringValue
-            << std::endl;
+            << '\n';
+    }
+
+    void Write(std::ostream &out, const char *source) {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        writeToken(out, LeftQuote);
+        writeToken(out, Value);
+        writeToken(out, RightQuote);
     }
 };
 
@@ -173,8 +265,13 @@ public:
         if (Value != nullptr) delete Value;
     }
 
-    void Print(std::string indent) {
-        std::cout << indent << Value->StringValue << std::endl;
+    void Print(std::ostream &out, std::string indent) {
+        out << indent << Value->StringValue << '\n';
+    }
+
+    void Write(std::ostream &out, const char *source) {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        writeToken(out, Value);
     }
 };
 
@@ -186,6 +283,8 @@ public:
     Token* ColonToken;
     JToken *Value;
     Token* TrailingComma;
+    size_t ValueBegin = 0;// Span of the value as parsed (same origin as Begin), it may have been replaced since
+    size_t ValueEnd = 0;
     JProperty(JString* name, Token* colon, JToken* value, Token* trailingComma){
         NameString = name;
         ColonToken = colon;
@@ -200,10 +299,55 @@ public:
         if (TrailingComma != nullptr) delete TrailingComma;
     }
 
-    void Print(std::string indent) {
-        std::cout << indent << "Property '" << NameString->Value->StringValue << "':" << std::endl;
-        Value->Print(indent + ONE_INDENT);
+    void Print(std::ostream &out, std::string indent) {
+        out << indent << "Property '" << NameString->Value->StringValue << "':\n";
+        Value->Print(out, indent + ONE_INDENT);
+    }
+
+    void Write(std::ostream &out, const char *source) {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        if (!Spanned) {
+            NameString->Write(out, source);
+            out << ':';
+            Value->Write(out, source);
+            if (TrailingComma != nullptr) out << ',';
+            return;
+        }
+        writeSource(out, source, Begin, ValueBegin);
+        Value->Write(out, source + Begin);
+        bool hadComma = End > ValueEnd;
+        writeSource(out, source, ValueEnd, hadComma && TrailingComma == nullptr ? End - 1 : End);
+        if (!hadComma && TrailingComma != nullptr) out << ',';
+    }
+};
+
+// Moves of a container's children that reparse hasn't applied to them, so
+// that an edit moves all the siblings after it at once instead of one by
+// one. A child's span is off by the sum of the moves at or before its index,
+// kept in a Fenwick tree.
+class SiblingShifts
+{
+public:
+    // Moves the children from index on, count is how many there are
+    void Move(size_t count, size_t from, ptrdiff_t delta)
+    {
+        if (from >= count) return;
+        if (tree.empty()) tree.assign(count, 0);
+        for (size_t i = from + 1; i <= tree.size(); i += i & -i) tree[i - 1] += delta;
+    }
+
+    ptrdiff_t At(size_t index)
+    {
+        ptrdiff_t shift = 0;
+        for (size_t i = std::min(index + 1, tree.size()); i > 0; i -= i & -i) shift += tree[i - 1];
+        return shift;
     }
+
+    bool Empty() { return tree.empty(); }
+    void Clear() { std::vector<ptrdiff_t>().swap(tree); }
+
+private:
+    std::vector<ptrdiff_t> tree;
 };
 
 class JObject : public JToken {
@@ -213,6 +357,8 @@ public:
     Token *BeginToken;
     std::vector<JProperty *> *Properties;
     Token *EndToken;
+    size_t ContentEnd = 0;// End of the last property as parsed (same origin as Begin), the rest is whitespace and '}'
+    SiblingShifts Shifts;// Pending moves of the properties' spans, see settleShifts
 
     JObject(Token *begin, std::vector<JProperty*>* properties, Token* end){
         BeginToken = begin;
@@ -231,12 +377,30 @@ public:
         }
     }
 
-    void Print(std::string indent) {
-        std::cout << indent << "Object:" << std::endl;
+    void Print(std::ostream &out, std::string indent) {
+        out << indent << "Object:\n";
         for (auto it = Properties->begin(); it != Properties->end(); ++it){
-            (*it)->Print(indent + ONE_INDENT);
+            (*it)->Print(out, indent + ONE_INDENT);
         }
     }
+
+    void Write(std::ostream &out, const char *source) {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        out << '{';
+        for (auto it = Properties->begin(); it != Properties->end(); ++it) {
+            if (Spanned && !(*it)->Spanned) {
+                // New property, indent it like its nearest parsed sibling
+                auto sibling = std::find_if(std::make_reverse_iterator(it), Properties->rend(), [](JProperty *p) { return p->Spanned; });
+                if (sibling != Properties->rend()) {
+                    auto shift = Shifts.At(Properties->rend() - sibling - 1);
+                    writeSource(out, source + Begin + shift + (*sibling)->Begin, 0, (*sibling)->NameString->Begin);
+                }
+            }
+            (*it)->Write(out, source + Begin + Shifts.At(it - Properties->begin()));
+        }
+        if (Spanned) writeSource(out, source, ContentEnd, End);
+        else out << '}';
+    }
 };
 
 class JArrayElement : public JToken {
@@ -245,6 +409,8 @@ public:
 
     JToken *Value;
     Token *TrailingComma;
+    size_t ValueBegin = 0;// Span of the value as parsed (same origin as Begin), it may have been replaced since
+    size_t ValueEnd = 0;
     JArrayElement(JToken *value, Token *trailingComma){
         Value = value;
         TrailingComma = trailingComma;
@@ -255,9 +421,71 @@ public:
         if (TrailingComma != nullptr) delete TrailingComma;
     }
 
-    void Print(std::string indent){
-        Value->Print(indent);
+    void Print(std::ostream &out, std::string indent){
+        Value->Print(out, indent);
     }
+
+    void Write(std::ostream &out, const char *source) {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        if (!Spanned) {
+            Value->Write(out, source);
+            if (TrailingComma != nullptr) out << ',';
+            return;
+        }
+        writeSource(out, source, Begin, ValueBegin);
+        Value->Write(out, source + Begin);
+        bool hadComma = End > ValueEnd;
+        writeSource(out, source, ValueEnd, hadComma && TrailingComma == nullptr ? End - 1 : End);
+        if (!hadComma && TrailingComma != nullptr) out << ',';
+    }
+};
+
+// The numbers of an array that holds nothing else, in one contiguous buffer
+// instead of a JArrayElement and JNumber per element. Values are int64 until
+// the first one that isn't (a fraction, exponent, -0 or out of range), which
+// promotes the whole buffer to double. Spellings that the value doesn't
+// reproduce, like 1.50 or 1e3, are kept on the side so Print and Write stay
+// exact.
+class PackedNumbers
+{
+public:
+    PackedNumbers(size_t origin) : Origin(origin) {}
+
+    size_t Size() { return isDouble ? doubles.size() : integers.size(); }
+    bool IsDouble() { return isDouble; }
+    const int64_t *Integers() { return integers.data(); }// Only while !IsDouble()
+    const double *Doubles() { return doubles.data(); }// Only once IsDouble()
+    double At(size_t index) { return isDouble ? doubles[index] : (double)integers[index]; }
+    std::string Spelling(size_t index);
+    double Sum();
+    double Min();// NaN when empty
+    double Max();
+    // Exact versions for int64 buffers, only while !IsDouble(). IntegerSum
+    // is false when the sum doesn't fit in int64, the others need Size() > 0.
+    bool IntegerSum(int64_t &sum);
+    int64_t IntegerMin();
+    int64_t IntegerMax();
+
+    // Adds a number as spelled in the source, given the offset of its first
+    // character and the end of its element (past the trailing comma). False,
+    // leaving the buffer as it was, if the number can't be stored.
+    bool Push(const std::string &text, size_t valueBegin, size_t end);
+    void Shrink();
+    size_t ContentEnd() { return ends.empty() ? 1 : ends.back(); }// Relative to the '['
+    // One JArrayElement per number, spanned relative to origin the way the
+    // parser would have built them
+    std::vector<JArrayElement *> *Box(size_t origin);
+
+    size_t Origin;// Source offset of the '[', the spans below are relative to it
+
+private:
+    bool isDouble = false;
+    std::vector<int64_t> integers;
+    std::vector<double> doubles;
+    std::vector<uint32_t> valueBegins;
+    std::vector<uint32_t> ends;
+    std::string spellingText;
+    std::vector<std::pair<uint32_t, uint32_t>> spellings;// Index and end in spellingText, sorted by index
 };
 
 class JArray : public JToken
@@ -268,6 +496,9 @@ public:
     Token *StartToken;
     std::vector<JArrayElement *> *Values;
     Token *EndToken;
+    size_t ContentEnd = 0;// End of the last element as parsed (same origin as Begin), the rest is whitespace and ']'
+    SiblingShifts Shifts;// Pending moves of the elements' spans, see settleShifts
+    PackedNumbers *Packed = nullptr;// Holds the elements instead of Values when they are all numbers, see boxElements
     JArray(Token *start, std::vector<JArrayElement *> *values, Token *end)
     {
         StartToken = start;
@@ -284,13 +515,43 @@ public:
             }
             delete Values;
         }
+        if (Packed != nullptr) delete Packed;
+    }
+
+    void Print(std::ostream &out, std::string indent) {
+        out << indent << "Array:\n";
+        for (auto it = Values->begin(); it != Values->end(); ++it) {
+            (*it)->Print(out, indent + ONE_INDENT);
+        }
+        if (Packed != nullptr) {
+            for (size_t i = 0; i < Packed->Size(); i++) {
+                out << indent << ONE_INDENT << Packed->Spelling(i) << '\n';
+            }
+        }
     }
 
-    void Print(std::string indent) {
-        std::cout << indent << "Array:" << std::endl;
+    void Write(std::ostream &out, const char *source) {
+        if (Spanned && !Modified) return writeSource(out, source, Begin, End);
+        out << '[';
+        if (Packed != nullptr) {// Only when detached, changing the elements boxes them
+            for (size_t i = 0; i < Packed->Size(); i++) {
+                if (i > 0) out << ',';
+                out << Packed->Spelling(i);
+            }
+        }
         for (auto it = Values->begin(); it != Values->end(); ++it) {
-            (*it)->Print(indent + ONE_INDENT);
+            if (Spanned && !(*it)->Spanned) {
+                // New element, indent it like its nearest parsed sibling
+                auto sibling = std::find_if(std::make_reverse_iterator(it), Values->rend(), [](JArrayElement *e) { return e->Spanned; });
+                if (sibling != Values->rend()) {
+                    auto shift = Shifts.At(Values->rend() - sibling - 1);
+                    writeSource(out, source + Begin + shift, (*sibling)->Begin, (*sibling)->ValueBegin);
+                }
+            }
+            (*it)->Write(out, source + Begin + Shifts.At(it - Values->begin()));
         }
+        if (Spanned) writeSource(out, source, ContentEnd, End);
+        else out << ']';
     }
 };
 
@@ -312,11 +573,23 @@ std::stringstream token;
 std::stack<Token *> tokens;
 std::stack<JTokenKind> nodeKinds;
 std::stack<JToken *> nodes;
+std::stack<PackedNumbers *> packedRuns;// Numbers of the open arrays that are still all numbers
+size_t position;// Source offset of the character being parsed
+size_t tokenStart;
+size_t tokenLength;
+bool parseFailed;
+bool reportErrors = true;// Off while reparse tries candidate regions
+
+void append(char c){
+    if (tokenLength++ == 0) tokenStart = position;
+    token << c;
+}
 
 void emit(TokenKind kind){
-    tokens.push(new Token(kind, token.str()));
+    tokens.push(new Token(kind, token.str(), tokenLength > 0 ? tokenStart : position));
     token.str("");
     token.clear();
+    tokenLength = 0;
 }
 
 ParseState *beginToken();
@@ -339,6 +612,82 @@ ParseState *parseTokenOrArrayEnd();
 ParseState *parseArrayEnd();
 
 ParseState *pushNode();
+JNumber *numberFromText(const std::string &text, size_t begin);
+
+// Driving the parse* states
+ParseState *beginParse(size_t offset = 0);// offset: where data starts in the source, for spans
+ParseState *feed(ParseState *state, const char *data, size_t length);
+JToken *endParse(ParseState *state);// The root node, or nullptr if there is none
+JToken *parseDocument(const char *data, size_t length);
+
+// Mutation API for lossless output: changed nodes and their ancestors are
+// marked Modified, everything else is still copied verbatim by Write.
+JToken *findPointer(JToken *root, const std::string &pointer);// JSON Pointer, nullptr if missing
+void markModified(JToken *node);
+void detach(JToken *node);// Drops the source span of a new subtree
+void boxElements(JArray *array);// Turns Packed numbers back into Values, before changing or indexing them
+void replaceValue(JToken *value, JToken *replacement);// Of a property or array element
+JProperty *setProperty(JObject *object, const std::string &name, JToken *value);
+bool removeProperty(JObject *object, const std::string &name);
+void appendElement(JArray *array, JToken *value);
+bool removeElement(JArray *array, size_t index);
+void writeDocument(std::ostream &out, JToken *root, const char *source, size_t length);
+bool applySet(JToken *&root, const std::string &assignment);
+
+// Print for a whole document, to fd. Containers are cut into slices of at
+// least minSlice source bytes that threads print into buffers of their own,
+// written out in order with writev as they complete; the output is the same
+// as Print's. False if the output could not be written.
+bool printDocument(JToken *root, unsigned threads, int fd, size_t minSlice = PRINT_SLICE_KIB * 1024);
+
+// Incremental reparse for editors and live reload
+struct TextEdit
+{
+    size_t Offset;
+    size_t Removed;
+    std::string Inserted;
+};
+
+// Document text for -edit. The spare capacity is kept as a gap at the last
+// edit, so a run of nearby edits moves only the bytes between them rather
+// than everything after them.
+class GapBuffer
+{
+public:
+    void Append(const char *data, size_t length) { Replace(Length(), 0, data, length); }
+    void Replace(size_t offset, size_t removed, const char *inserted, size_t length);
+    size_t Length() { return text.size() - gapLength; }
+    const char *Data();// Closes the gap, for reading the whole document
+
+    // Calls piece(data, length) for the parts of [begin, end) on either side
+    // of the gap
+    template <typename F>
+    void Read(size_t begin, size_t end, F piece)
+    {
+        if (begin < gapBegin) piece(text.data() + begin, std::min(end, gapBegin) - begin);
+        if (end > gapBegin) {
+            auto from = std::max(begin, gapBegin);
+            piece(text.data() + from + gapLength, end - from);
+        }
+    }
+
+private:
+    void moveGap(size_t offset);
+
+    std::string text;
+    size_t gapBegin = 0;
+    size_t gapLength = 0;
+};
+
+// Applies edit to source and brings root (parsed from source before the
+// edit, with no mutations since) up to date. Only the innermost value whose
+// span strictly contains the edit is parsed again, climbing to enclosing
+// values when the edited text doesn't parse on its own; the whole document
+// is parsed only when no enclosing value does. Returns the root, which is a
+// new node after a full parse, and the number of bytes parsed in reparsed;
+// parseFailed is left set when the edited document doesn't parse.
+JToken *reparse(JToken *root, GapBuffer &source, const TextEdit &edit, size_t *reparsed);
+bool parseEdit(const std::string &argument, TextEdit &edit);// offset:removed:text
 
 // Terminal states
 ParseState *eof();
@@ -352,535 +701,4041 @@ ParseState *ignoreWhitespace(ParseState *);
 ParseState *unpeek(ParseState *, char);
 ParseState *readLiteral(std::string sequence, TokenKind literalKind);
 
-int main(int argc, char *argv[])
+// Cursor over an in-memory buffer, for the modes that never build a JToken
+// tree. Follows the same grammar and dialect flags as the parse* states, but
+// reads straight from the buffer and never allocates. Like parseString,
+// escapes aren't parsed: a string ends at the first '"'.
+struct JsonCursor
 {
-    bool noprint = false;
-    bool bench = false;
-    for (int i = 0; i < argc - 1; i++)
+    JsonCursor(const char *data, size_t length)
     {
-        auto arg = std::string(argv[i]);
-        if (arg == "-noprint") {
-            noprint = true;
-        }
-        else if (arg == "-bench") {
-            bench = true;
-        }
+        Begin = data;
+        Pos = data;
+        End = data + length;
+        Error = nullptr;
+        Depth = 0;
     }
+    const char *Begin;
+    const char *Pos;
+    const char *End;
+    const char *Error;// First error, Pos is left on the offending character
+    int Depth;
+};
 
-    if (argc < 1) {
-        std::cerr << "Filename is required" << std::endl;
-        return 1;
-    }
+bool cursorError(JsonCursor &cursor, const char *message);
+void skipWhitespace(JsonCursor &cursor);
+bool scanString(JsonCursor &cursor, const char **value, size_t *length);
+bool scanNumber(JsonCursor &cursor, const char **value, size_t *length, bool *isInteger);
+bool scanLiteral(JsonCursor &cursor, const char *sequence);
+bool scanContainerBegin(JsonCursor &cursor, char bracket);
+bool scanNextProperty(JsonCursor &cursor, bool &first, const char **name, size_t *nameLength);
+bool scanNextElement(JsonCursor &cursor, bool &first);
+bool skipValue(JsonCursor &cursor);
 
-    auto filename = std::string(argv[argc - 1]);
-    std::ifstream file(filename);
+// Typed binding: parses straight into user structs without building a
+// JToken tree. Declare the fields once next to the struct:
+//
+//     struct Point { double x; double y; std::string label; };
+//     JSON_BINDING(Point,
+//         JSON_FIELD(Point, x),
+//         JSON_FIELD(Point, y),
+//         JSON_FIELD_AS(Point, label, "name"));
+//
+// then call bindJson(data, length, point, error). Supported members are bool,
+// integers, floating point, std::string, std::vector, std::optional (null
+// resets it) and other bound structs. Unknown keys are skipped, missing keys
+// keep their current value.
 
-    if (!file.is_open()) {
-        std::cerr << "Could not open the file - '"
-             << filename << "'" << std::endl;
-        return 1;
-    }
+template <typename Owner, typename Member>
+struct JsonField
+{
+    const char *Name;
+    Member Owner::*Pointer;
+};
 
+template <typename T>
+struct JsonBinding;
 
-    auto start = std::chrono::high_resolution_clock::now();
-    auto state = ignoreWhitespace(beginToken());
-    char c;
-    while (file.get(c))
-    {
-        // std::cout << (*iter) << std::endl;
-        auto next = ((*state)(c));
-        delete state;
-        state = next;
+#define JSON_FIELD_AS(type, member, name) JsonField<type, decltype(type::member)>{ name, &type::member }
+#define JSON_FIELD(type, member) JSON_FIELD_AS(type, member, #member)
+#define JSON_BINDING(type, ...)                                           \
+    template <>                                                           \
+    struct JsonBinding<type>                                              \
+    {                                                                     \
+        static constexpr auto Fields = std::make_tuple(__VA_ARGS__);      \
     }
-    auto end = std::chrono::high_resolution_clock::now();
-    file.close();
 
-    if (nodes.size() > 1 || tokens.size() > 0) {
-        std::cerr << "Unexpected EOF" << std::endl;
-    }
-    else if (!noprint && !nodes.empty()) {
-        nodes.top()->Print("");
-    }
+struct JsonBindError
+{
+    std::string Path;// e.g. $.points[3].x
+    std::string Message;
+    size_t Offset;
+};
 
-    if (bench) {
-        std::cout
-            << "Parsing '" << filename << "' Completed in "
-            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
-            << "ms."
-            << std::endl;
+// Known keys are dispatched through a perfect hash computed at compile time
+// by hash and displace: names are spread over buckets by their hash, and each
+// bucket, fullest first, gets the smallest displacement that moves all of its
+// names to free slots. That takes a few tries per bucket however many fields
+// there are, and a lookup stays one hash, two table reads and one compare.
+constexpr uint32_t hashKey(const char *key, size_t length, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
     }
+    return hash ^ (hash >> 15);
+}
 
-    while (!nodes.empty()){
-        if (nodes.top() != nullptr) {
-            // nodes.top()->Print("");
-            delete nodes.top();
-        }
-        nodes.pop();
-    };
+constexpr size_t keyLength(const char *key)
+{
+    size_t length = 0;
+    while (key[length] != '\0') length++;
+    return length;
+}
 
-    while (!tokens.empty()){
-        if (tokens.top() != nullptr) {
-            // std::cout << "Token: " << tokens.top()->Kind << " Value: " << tokens.top()->StringValue << std::endl;
-            delete tokens.top();
-        }
-        tokens.pop();
-    };
+constexpr size_t hashTableSize(size_t count)
+{
+    size_t size = 1;
+    while (size < count * 2) size *= 2;
+    return size;
+}
 
-    return 0;
+// Double hashing on the high bits, so names sharing a bucket (the low bits)
+// still move apart; the step is odd, so the displacements reach every slot
+constexpr size_t hashSlot(uint32_t hash, uint32_t displacement, size_t size)
+{
+    return ((hash >> 16) + displacement * ((hash >> 4) | 1)) & (size - 1);
 }
 
-ParseState *beginToken(){
-    return new ParseState([](char c) {
-        if (std::isdigit(c)) {
-            nodeKinds.push(JTokenKind::NumberToken);
-            tokens.push(nullptr);// leading sign
-            token << c;
-            if (!AllowSuperfluousLeadingZeroes && c == '0') {
-                emit(TokenKind::Integer);
-                return parseOptionalDecimal();
-            }
-            return parseInteger();
+constexpr bool uniqueNames(const char *const *names, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = i + 1; j < count; j++) {
+            auto length = keyLength(names[i]);
+            bool same = length == keyLength(names[j]);
+            for (size_t k = 0; k < length && same; k++) same = names[i][k] == names[j][k];
+            if (same) return false;
         }
-        switch (c) {
-            case '{':
-                nodeKinds.push(JTokenKind::ObjectToken);
-                token << c;
-                emit(TokenKind::LeftCBracket);
-                return ignoreWhitespace(parseObjectPropertyOrEnd());
-            case '[':
-                nodeKinds.push(JTokenKind::ArrayToken);
-                token << c;
-                emit(TokenKind::LeftSQBracket);
-                return ignoreWhitespace(parseTokenOrArrayEnd());
-            case '"':
-                nodeKinds.push(JTokenKind::StringToken);
-                token << c;
-                emit(TokenKind::DoubleQuote);
-                return parseString();
-            case '-':
-                nodeKinds.push(JTokenKind::NumberToken);
-                token << c;
-                emit(TokenKind::Sign);
-                return parseIntegerStart();
-            case 't':
-                nodeKinds.push(JTokenKind::LiteralToken);
-                return unpeek(readLiteral("true", TokenKind::TrueLiteral), c);
-            case 'f':
-                nodeKinds.push(JTokenKind::LiteralToken);
-                return unpeek(readLiteral("false", TokenKind::FalseLiteral), c);
-            case 'n':
-                nodeKinds.push(JTokenKind::LiteralToken);
-                return unpeek(readLiteral("null", TokenKind::NullLiteral), c);
-            }
-        return error("Expected beginning of token.");
-    });
+    }
+    return true;
 }
 
-ParseState *parseObjectPropertyOrEnd(){
-    return new ParseState([](char c) { 
-        switch (c)
-        {
-        case '"':
-            nodeKinds.push(JTokenKind::PropertyToken);
-            nodeKinds.push(JTokenKind::PropertyNameToken);
-            token << c;
-            emit(TokenKind::DoubleQuote);
-            return parseString();
+template <size_t Buckets>
+struct PerfectHash
+{
+    bool Found;
+    uint32_t Seed;
+    std::array<uint32_t, Buckets> Displacements;
+};
+
+// Another seed is only needed when two names hash alike in every bit the
+// slots use, so a handful of seeds is plenty; Found is false past that,
+// which only duplicate names should cause
+template <size_t Count, size_t Size, size_t Buckets>
+constexpr PerfectHash<Buckets> findPerfectHash(const std::array<const char *, Count> &names)
+{
+    for (uint32_t seed = 0; seed < 16; seed++) {
+        PerfectHash<Buckets> hash{true, seed, {}};
+        std::array<uint32_t, Count> hashes{};
+        std::array<size_t, Buckets> fills{};
+        size_t fullest = 0;
+        for (size_t i = 0; i < Count; i++) {
+            hashes[i] = hashKey(names[i], keyLength(names[i]), seed);
+            fullest = std::max(fullest, ++fills[hashes[i] & (Buckets - 1)]);
         }
-        return unpeek(parseObjectEnd(), c);// Or End
-    });
+        std::array<bool, Size> used{};
+        for (size_t fill = fullest; fill > 0 && hash.Found; fill--) {
+            for (size_t bucket = 0; bucket < Buckets && hash.Found; bucket++) {
+                if (fills[bucket] != fill) continue;
+                std::array<size_t, Count> members{};
+                size_t count = 0;
+                for (size_t i = 0; i < Count; i++) {
+                    if ((hashes[i] & (Buckets - 1)) == bucket) members[count++] = i;
+                }
+                hash.Found = false;
+                for (uint32_t displacement = 0; displacement < Size && !hash.Found; displacement++) {
+                    hash.Found = true;
+                    for (size_t i = 0; i < count && hash.Found; i++) {
+                        auto slot = hashSlot(hashes[members[i]], displacement, Size);
+                        hash.Found = !used[slot];
+                        for (size_t j = 0; j < i && hash.Found; j++) {
+                            hash.Found = slot != hashSlot(hashes[members[j]], displacement, Size);
+                        }
+                    }
+                    if (hash.Found) {
+                        hash.Displacements[bucket] = displacement;
+                        for (size_t i = 0; i < count; i++) used[hashSlot(hashes[members[i]], displacement, Size)] = true;
+                    }
+                }
+            }
+        }
+        if (hash.Found) return hash;
+    }
+    return PerfectHash<Buckets>{false, 0, {}};
 }
 
-ParseState *parseObjectPropertyRequired(){
-    return new ParseState([](char c) { 
-        switch (c)
-        {
-        case '"':
-            nodeKinds.push(JTokenKind::PropertyToken);
-            nodeKinds.push(JTokenKind::PropertyNameToken);
-            token << c;
-            emit(TokenKind::DoubleQuote);
-            return parseString();
+template <typename T>
+struct JsonFieldTable
+{
+    using Fields = std::remove_const_t<decltype(JsonBinding<T>::Fields)>;
+    static constexpr size_t Count = std::tuple_size<Fields>::value;
+    static constexpr size_t Size = hashTableSize(Count);
+    static constexpr size_t Buckets = std::max(Size / 4, (size_t)1);
+
+    template <size_t... I>
+    static constexpr std::array<const char *, Count> names(std::index_sequence<I...>)
+    {
+        return {{ std::get<I>(JsonBinding<T>::Fields).Name... }};
+    }
+    static constexpr std::array<const char *, Count> Names = names(std::make_index_sequence<Count>());
+    static constexpr bool Unique = uniqueNames(Names.data(), Count);
+    static_assert(Unique, "JSON_BINDING has two fields with the same name");
+    static constexpr PerfectHash<Buckets> Hash = Unique ? findPerfectHash<Count, Size, Buckets>(Names) : PerfectHash<Buckets>{true, 0, {}};
+    static_assert(Hash.Found, "No perfect hash for the JSON_BINDING field names");
+
+    static constexpr size_t slot(const char *key, size_t length)
+    {
+        auto hash = hashKey(key, length, Hash.Seed);
+        return hashSlot(hash, Hash.Displacements[hash & (Buckets - 1)], Size);
+    }
+
+    static constexpr std::array<int, Size> slots()
+    {
+        std::array<int, Size> slots{};
+        for (size_t i = 0; i < Size; i++) slots[i] = -1;
+        for (size_t i = 0; i < Count; i++) {
+            slots[slot(Names[i], keyLength(Names[i]))] = (int)i;
         }
-        return expectedInput("'\"'", c);
-    });
+        return slots;
+    }
+    static constexpr std::array<int, Size> Slots = slots();
+
+    static constexpr std::array<size_t, Count> lengths()
+    {
+        std::array<size_t, Count> lengths{};
+        for (size_t i = 0; i < Count; i++) lengths[i] = keyLength(Names[i]);
+        return lengths;
+    }
+    static constexpr std::array<size_t, Count> Lengths = lengths();
+
+    // Keys may hold NUL bytes, so the lengths are compared before the bytes
+    static int find(const char *key, size_t length)
+    {
+        int field = Slots[slot(key, length)];
+        if (field < 0) return -1;
+        return Lengths[field] == length && std::memcmp(Names[field], key, length) == 0 ? field : -1;
+    }
+};
+
+template <typename T, typename = void>
+struct hasJsonBinding : std::false_type {};
+template <typename T>
+struct hasJsonBinding<T, std::void_t<decltype(JsonBinding<T>::Fields)>> : std::true_type {};
+
+template <typename T>
+struct isVector : std::false_type {};
+template <typename T>
+struct isVector<std::vector<T>> : std::true_type {};
+
+template <typename T>
+struct isOptional : std::false_type {};
+template <typename T>
+struct isOptional<std::optional<T>> : std::true_type {};
+
+template <typename T>
+bool bindValue(JsonCursor &cursor, T &out, JsonBindError &error);
+
+inline bool bindMismatch(JsonCursor &cursor, JsonBindError &error, const char *expected)
+{
+    if (cursor.Error == nullptr) {
+        error.Message = std::string("Expected ") + expected;
+    }
+    return false;
 }
 
-ParseState *parseObjectEnd(){
-    return new ParseState([](char c) { 
-        switch (c)
-        {
-        case '}':
-            token << c;
-            emit(TokenKind::LeftCBracket);
-            return pushNode();
-        }
-        return expectedInput("'}' or ','", c);
-    });
+template <typename T, size_t I>
+bool bindField(JsonCursor &cursor, T &out, JsonBindError &error)
+{
+    auto &field = std::get<I>(JsonBinding<T>::Fields);
+    if (bindValue(cursor, out.*(field.Pointer), error)) return true;
+    error.Path.insert(0, std::string(".") + field.Name);
+    return false;
 }
 
-ParseState *parseString(){// TODO JOSH, parse escapes
-    return new ParseState([](char c) {
-        switch (c)
-        {
-        case '"':
-            emit(TokenKind::String);
-            token << c;
-            emit(TokenKind::DoubleQuote);
-            return pushNode();
+template <typename T, size_t... I>
+constexpr std::array<bool (*)(JsonCursor &, T &, JsonBindError &), sizeof...(I)> fieldBinders(std::index_sequence<I...>)
+{
+    return {{ &bindField<T, I>... }};
+}
+
+template <typename T>
+bool bindObject(JsonCursor &cursor, T &out, JsonBindError &error)
+{
+    using Table = JsonFieldTable<T>;
+    static constexpr auto binders = fieldBinders<T>(std::make_index_sequence<Table::Count>());
+
+    if (cursor.Pos == cursor.End || *cursor.Pos != '{') return bindMismatch(cursor, error, "object");
+    if (!scanContainerBegin(cursor, '{')) return false;
+    bool first = true;
+    const char *name;
+    size_t nameLength;
+    while (scanNextProperty(cursor, first, &name, &nameLength)) {
+        int field = Table::find(name, nameLength);
+        if (field < 0) {
+            if (!skipValue(cursor)) return false;
         }
-        token << c;
-        return parseString();
-    });
+        else if (!binders[field](cursor, out, error)) {
+            return false;
+        }
+    }
+    return cursor.Error == nullptr;
 }
 
-ParseState *parsePropertyValue() {
+template <typename T>
+bool bindValue(JsonCursor &cursor, T &out, JsonBindError &error)
+{
+    const char *value;
+    size_t length;
+    if constexpr (std::is_same<T, bool>::value) {
+        if (cursor.Pos < cursor.End && *cursor.Pos == 't') {
+            out = true;
+            return scanLiteral(cursor, "true");
+        }
+        if (cursor.Pos < cursor.End && *cursor.Pos == 'f') {
+            out = false;
+            return scanLiteral(cursor, "false");
+        }
+        return bindMismatch(cursor, error, "true or false");
+    }
+    else if constexpr (std::is_arithmetic<T>::value) {
+        bool isInteger;
+        if (cursor.Pos == cursor.End || (*cursor.Pos != '-' && !std::isdigit((unsigned char)*cursor.Pos))) {
+            return bindMismatch(cursor, error, "number");
+        }
+        auto start = cursor.Pos;
+        if (!scanNumber(cursor, &value, &length, &isInteger)) return false;
+        if (std::is_integral<T>::value && !isInteger) {
+            cursor.Pos = start;
+            return bindMismatch(cursor, error, "integer");
+        }
+        auto result = std::from_chars(value, value + length, out);
+        if (result.ec != std::errc() || result.ptr != value + length) {
+            cursor.Pos = start;
+            return bindMismatch(cursor, error, "number in range");
+        }
+        return true;
+    }
+    else if constexpr (std::is_same<T, std::string>::value) {
+        if (cursor.Pos == cursor.End || *cursor.Pos != '"') return bindMismatch(cursor, error, "string");
+        if (!scanString(cursor, &value, &length)) return false;
+        out.assign(value, length);
+        return true;
+    }
+    else if constexpr (isOptional<T>::value) {
+        if (cursor.Pos < cursor.End && *cursor.Pos == 'n') {
+            out.reset();
+            return scanLiteral(cursor, "null");
+        }
+        if (!out.has_value()) out.emplace();
+        return bindValue(cursor, *out, error);
+    }
+    else if constexpr (isVector<T>::value) {
+        if (cursor.Pos == cursor.End || *cursor.Pos != '[') return bindMismatch(cursor, error, "array");
+        if (!scanContainerBegin(cursor, '[')) return false;
+        out.clear();
+        bool first = true;
+        while (scanNextElement(cursor, first)) {
+            out.emplace_back();
+            if (!bindValue(cursor, out.back(), error)) {
+                error.Path.insert(0, "[" + std::to_string(out.size() - 1) + "]");
+                return false;
+            }
+        }
+        return cursor.Error == nullptr;
+    }
+    else {
+        static_assert(hasJsonBinding<T>::value, "Type needs a JSON_BINDING declaration");
+        return bindObject(cursor, out, error);
+    }
+}
+
+template <typename T>
+bool bindJson(const char *data, size_t length, T &out, JsonBindError &error)
+{
+    JsonCursor cursor(data, length);
+    error.Path.clear();
+    error.Message.clear();
+    skipWhitespace(cursor);
+    bool bound = bindValue(cursor, out, error);
+    if (bound) {
+        skipWhitespace(cursor);
+        if (cursor.Pos != cursor.End) bound = cursorError(cursor, "Expected end of file");
+    }
+    if (!bound) {
+        if (cursor.Error != nullptr) error.Message = cursor.Error;
+        error.Path.insert(0, "$");
+        error.Offset = cursor.Pos - cursor.Begin;
+    }
+    return bound;
+}
+
+// Columnar extraction, for -columnar: a top-level array of objects is pivoted
+// into one typed column per key in a single pass of the JsonCursor, without
+// building a JToken per record. The schema is inferred as records arrive:
+//  - a key missing from a record is null in that row
+//  - a key first seen in a later record adds a column, null in earlier rows
+//  - a key repeated within a record keeps its first value
+//  - int64 and double values promote the column to double, -0 and integers
+//    out of int64 range count as doubles
+//  - any other mix of types, or an object or array value, turns the column
+//    into a JSON column holding each value's text; values already stored
+//    are spelled out again
+enum ColumnKind
+{
+    NullColumn,// No value other than null yet
+    BoolColumn,
+    IntegerColumn,
+    DoubleColumn,
+    StringColumn,
+    JsonColumn,
+};
+
+struct Column
+{
+    std::string Name;
+    ColumnKind Kind = NullColumn;
+    size_t Rows = 0;
+    size_t NullCount = 0;
+    // Bit per row, like Bools. Null rows hold false, 0 or "" in the values
+    std::vector<uint64_t> Validity;
+
+    std::vector<uint64_t> Bools;
+    std::vector<int64_t> Integers;
+    std::vector<double> Doubles;
+    std::string Chars;// Strings (as written, between the quotes) and JSON text, back to back
+    std::vector<size_t> Offsets;// Row i is Chars[Offsets[i], Offsets[i + 1])
+
+    bool IsValid(size_t row) { return (Validity[row / 64] >> (row % 64)) & 1; }
+    bool Bool(size_t row) { return (Bools[row / 64] >> (row % 64)) & 1; }
+    std::string Text(size_t row) { return Chars.substr(Offsets[row], Offsets[row + 1] - Offsets[row]); }
+};
+
+struct ColumnTable
+{
+    size_t Rows = 0;
+    std::vector<Column> Columns;// In the order the keys were first seen
+};
+
+bool extractColumns(const char *data, size_t length, ColumnTable &table, JsonBindError &error);// Errors as for bindJson
+void printColumns(std::ostream &out, ColumnTable &table);
+
+// Grammar check only, for -validate. Input can be fed in chunks of any size;
+// container nesting lives in a fixed bitmap, so it never allocates. Strings
+// end at the first '"', as in the parse* states, which don't parse escapes.
+class Validator
+{
+public:
+    Validator();
+    bool Feed(const char *data, size_t length);// false once an error was found
+    bool Finish();
+
+    const char *Error;
+    size_t ErrorOffset;
+    size_t ErrorLine;
+    size_t ErrorColumn;
+
+private:
+    enum State
+    {
+        Value,
+        ValueOrArrayEnd,
+        PropertyOrObjectEnd,
+        PropertyRequired,
+        PropertyName,
+        StringValue,
+        PropertyColon,
+        AfterValue,
+        NumberIntegerStart,
+        NumberInteger,
+        NumberAfterZero,
+        NumberFractionStart,
+        NumberFraction,
+        NumberExpSign,
+        NumberExpStart,
+        NumberExp,
+        Literal,
+        Done,
+        Failed,
+    };
+
+    bool fail(const char *message, const char *data, const char *at);
+    bool inObject() { return (containers[(depth - 1) / 64] >> ((depth - 1) % 64)) & 1; }
+
+    State state;
+    const char *literal;// Rest of the true/false/null being matched
+    uint64_t containers[(MaxNestingDepth + 63) / 64];// Bit set: object, clear: array
+    int depth;
+    size_t offset;// Of the start of the current chunk
+    size_t line;
+    size_t lineStart;
+};
+
+// Lock-free queue between exactly one producer and one consumer thread.
+template <typename T>
+class SpscQueue
+{
+public:
+    SpscQueue(size_t capacity)
+    {
+        size = 1;
+        while (size < capacity) size *= 2;
+        items = new T[size];
+        head = 0;
+        tail = 0;
+    }
+    ~SpscQueue() { delete[] items; }
+
+    bool Push(T item)// Producer, false when full
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == size) return false;
+        items[h & (size - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    bool Front(T &item)// Consumer, false when empty
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = items[t & (size - 1)];
+        return true;
+    }
+    void Pop()// Consumer, after a successful Front
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    T *items;
+    size_t size;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+// Spins briefly, then backs off to sleeping, until ready() holds.
+template <typename F>
+void waitUntil(F ready)
+{
+    for (int spins = 0; !ready(); spins++) {
+        if (spins < 256) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+// Fixed set of buffers handed from one pipeline stage to the next: full
+// buffers go downstream and come back empty through a second queue.
+class BufferRing
+{
+public:
+    BufferRing(size_t count, size_t size);
+    ~BufferRing();
+
+    // Producer side
+    char *Acquire();// Blocks until a buffer is free, nullptr once cancelled
+    char *TryAcquire();// nullptr when none is free right now
+    void Publish(char *buffer, size_t length);
+    void Close(const char *error);// End of input, error is nullptr on success
+    bool Cancelled() { return cancelled.load(std::memory_order_acquire); }
+
+    // Consumer side
+    bool Next(const char *&data, size_t &length);// Blocks, false at end of input
+    void Release();
+    void Cancel();// Consumer is done early, stops the producer
+
+    const size_t BufferCount;
+    const size_t BufferSize;
+    const char *Error;// Only read once Next returned false
+    std::chrono::nanoseconds Waited;// Consumer time spent blocked on the producer
+
+private:
+    struct Chunk
+    {
+        char *Data;
+        size_t Length;
+    };
+
+    std::vector<char *> buffers;
+    SpscQueue<Chunk> full;
+    SpscQueue<char *> empty;
+    std::atomic<bool> closed;
+    std::atomic<bool> cancelled;
+};
+
+// Just enough of io_uring for FileReader, straight on the syscalls.
+class Uring
+{
+public:
+    Uring();
+    ~Uring();
+    bool Setup(unsigned entries);
+    void PrepareRead(int fd, char *buffer, unsigned length, uint64_t offset, uint64_t tag);
+    int Submit(unsigned waitFor);// -errno on failure
+    bool Complete(uint64_t &tag, int &result);// Pops one completion if there is one
+
+private:
+    int ringFd;
+    unsigned toSubmit;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+};
+
+// First pipeline stage: reads the file into a BufferRing on its own thread,
+// and closes it when done.
+// Uses io_uring to keep a read in flight for every buffer when the kernel
+// allows it, and falls back to one pread at a time otherwise. Anything but a
+// regular file is read sequentially with read().
+class FileReader
+{
+public:
+    FileReader(int fd, BufferRing &ring);
+    ~FileReader();
+    void Stop();// Cancels the ring and waits for the reader thread
+
+    const char *Backend;
+    std::chrono::nanoseconds ReadTime;// Reader thread time spent in or waiting on reads
+
+private:
+    void run();
+    const char *readUring(Uring &uring);
+    const char *readPread(bool seekable);// read() from the current position otherwise
+
+    int fd;
+    BufferRing &ring;
+    std::thread reader;
+};
+
+// Feeds the file to the parser through a FileReader, which takes over fd. Gzip and zstd input is
+// recognised by its magic bytes and decompressed on a second thread, plain
+// input is handed over in the buffers it was read into.
+class InputPipeline
+{
+public:
+    InputPipeline(int fd, size_t bufferCount, size_t bufferSize);
+    ~InputPipeline();
+
+    bool Next(const char *&data, size_t &length) { return source->Next(data, length); }
+    void Release() { source->Release(); }
+    const char *Error() { return source->Error; }// Only once Next returned false
+    void Stop();// Consumer is done early: stops and joins the threads, PrintStats is safe after it
+    void PrintStats(std::ostream &out);// Only once Next returned false, or after Stop
+
+    const char *Format;
+    std::chrono::nanoseconds DecompressTime;
+
+private:
+    void decompress();
+    const char *inflateGzip();
+    const char *decompressZstd();
+
+    BufferRing raw;
+    std::unique_ptr<BufferRing> decoded;
+    BufferRing *source;
+    FileReader reader;
+    std::thread decompressor;
+};
+
+int validateFile(InputPipeline &input, const std::string &filename, bool bench, bool stats);
+int columnarFile(InputPipeline &input, const std::string &filename, bool noprint, bool bench, bool stats);
+
+// Differential check, for -differential and the fuzz build: the same bytes
+// go through every mode that parses them, which have to agree on whether the
+// input is valid and, where they produce output, on the output. The DOM
+// parser is fed whole and a byte at a time, the Validator likewise, the
+// JsonCursor skips the document, and when the DOM accepts it, -roundtrip,
+// the threaded printer, -columnar (for arrays of objects) and bindJson (into
+// a small record) are checked against it. Inputs nested deeper than MaxNestingDepth only have to agree between
+// the modes that enforce it.
+struct ModeTiming
+{
+    const char *Mode;
+    std::chrono::nanoseconds Time;// Best of the runs
+};
+
+struct DifferentialResult
+{
+    bool Accepted;// By the DOM parser
+    std::string Disagreement;// Empty when the modes agree
+    std::vector<ModeTiming> Timings;
+    std::chrono::nanoseconds Calibration;// A fixed loop over the input, timed along with the modes
+};
+
+// repeat: run each mode at least TIMING_MIN_RUNS times and for a few
+// milliseconds and keep the best time, for stable throughput numbers
+bool checkModes(const char *data, size_t length, bool repeat, DifferentialResult &result);
+bool recordInput(const std::string &directory, const char *data, size_t length);// As <hash>.json, once
+// baseline: checked against, or rewritten for filename when recordBaseline
+int differentialFile(InputPipeline &input, const std::string &filename, bool bench, const std::string &corpus, long slowNsPerByte, const std::string &baseline, bool recordBaseline);
+
+#ifndef JSONPARSE_FUZZ
+int main(int argc, char *argv[])
+{
+    bool noprint = false;
+    bool bench = false;
+    bool validate = false;
+    bool columnar = false;
+    bool differential = false;
+    std::string corpus;
+    std::string baseline;
+    bool recordBaseline = false;
+    long slowNsPerByte = SLOW_NS_PER_BYTE;
+    bool stats = false;
+    bool roundtrip = false;
+    std::vector<std::string> sets;
+    std::vector<TextEdit> edits;
+    std::vector<std::string> summaries;
+    long bufferCount = INPUT_BUFFER_COUNT;
+    long bufferKiB = INPUT_BUFFER_KIB;
+    long printThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < argc - 1; i++)
+    {
+        auto arg = std::string(argv[i]);
+        if (arg == "-noprint") {
+            noprint = true;
+        }
+        else if (arg == "-bench") {
+            bench = true;
+        }
+        else if (arg == "-validate") {
+            validate = true;
+        }
+        else if (arg == "-columnar") {
+            columnar = true;
+        }
+        else if (arg == "-differential") {
+            differential = true;
+        }
+        else if (arg == "-corpus" && i + 1 < argc - 1) {
+            corpus = argv[++i];
+        }
+        else if (arg == "-slow" && i + 1 < argc - 1) {
+            slowNsPerByte = std::atol(argv[++i]);
+        }
+        else if (arg == "-baseline" && i + 1 < argc - 1) {
+            baseline = argv[++i];
+        }
+        else if (arg == "-record-baseline" && i + 1 < argc - 1) {
+            baseline = argv[++i];
+            recordBaseline = true;
+        }
+        else if (arg == "-stats") {
+            stats = true;
+        }
+        else if (arg == "-roundtrip") {
+            roundtrip = true;
+        }
+        else if (arg == "-set" && i + 1 < argc - 1) {
+            roundtrip = true;
+            sets.push_back(argv[++i]);
+        }
+        else if (arg == "-edit" && i + 1 < argc - 1) {
+            TextEdit edit;
+            if (!parseEdit(argv[++i], edit)) {
+                std::cerr << "Expected -edit offset:removed:text, got '" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+            edits.push_back(edit);
+        }
+        else if (arg == "-numbers" && i + 1 < argc - 1) {
+            summaries.push_back(argv[++i]);
+        }
+        else if (arg == "-threads" && i + 1 < argc - 1) {
+            printThreads = std::atol(argv[++i]);
+        }
+        else if (arg == "-buffers" && i + 1 < argc - 1) {
+            bufferCount = std::atol(argv[++i]);
+        }
+        else if (arg == "-buffersize" && i + 1 < argc - 1) {
+            bufferKiB = std::atol(argv[++i]);
+        }
+    }
+
+    if (bufferCount < 1 || bufferKiB < 1) {
+        std::cerr << "-buffers and -buffersize (KiB) must be positive" << std::endl;
+        return 1;
+    }
+    if (printThreads < 1) {
+        std::cerr << "-threads must be positive" << std::endl;
+        return 1;
+    }
+
+    if (argc < 1) {
+        std::cerr << "Filename is required" << std::endl;
+        return 1;
+    }
+
+    auto filename = std::string(argv[argc - 1]);
+    int file = open(filename.c_str(), O_RDONLY);
+
+    if (file < 0) {
+        std::cerr << "Could not open the file - '"
+             << filename << "'" << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    InputPipeline input(file, bufferCount, bufferKiB * 1024);
+    if (validate) {
+        return validateFile(input, filename, bench, stats);
+    }
+    if (columnar) {
+        return columnarFile(input, filename, noprint, bench, stats);
+    }
+    if (differential) {
+        return differentialFile(input, filename, bench, corpus, slowNsPerByte, baseline, recordBaseline);
+    }
+
+    GapBuffer source;// Only kept for -roundtrip and -edit
+    auto state = beginParse();
+    const char *chunk;
+    size_t length;
+    while (input.Next(chunk, length))
+    {
+        if (roundtrip || !edits.empty()) source.Append(chunk, length);
+        state = feed(state, chunk, length);
+        input.Release();
+    }
+    auto root = endParse(state);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if (input.Error() != nullptr) {
+        std::cerr << "Could not read '" << filename << "': " << input.Error() << std::endl;
+        return 1;
+    }
+
+    std::chrono::nanoseconds editTime(0);
+    size_t editReparsed = 0;
+    // An invalid document stays editable, reparse parses it whole
+    for (auto iter = edits.begin(); iter != edits.end(); ++iter) {
+        if (iter->Offset + iter->Removed > source.Length()) {
+            std::cerr << "Edit at " << iter->Offset << " is past the end of the document" << std::endl;
+            return 1;
+        }
+        size_t reparsed;
+        auto editStart = std::chrono::high_resolution_clock::now();
+        root = reparse(root, source, *iter, &reparsed);
+        auto editEnd = std::chrono::high_resolution_clock::now();
+        editTime += editEnd - editStart;
+        editReparsed += reparsed;
+        if (bench) {
+            std::cout
+                << "Reparsing edit at " << iter->Offset << " Completed in "
+                << std::chrono::duration_cast<std::chrono::microseconds>(editEnd - editStart).count()
+                << "us, " << reparsed << " of " << source.Length() << " bytes parsed."
+                << std::endl;
+        }
+    }
+    if (bench && edits.size() > 1) {
+        std::cout
+            << "Reparsing " << edits.size() << " edits Completed in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(editTime).count()
+            << "us, " << editReparsed << " bytes parsed."
+            << std::endl;
+    }
+    if (!edits.empty() && parseFailed) {
+        std::cerr << "The edited document is not valid JSON" << std::endl;
+        delete root;
+        return 1;
+    }
+
+    // At full precision like -columnar, and in place of the tree print
+    auto precision = std::cout.precision(std::numeric_limits<double>::max_digits10);
+    for (auto iter = summaries.begin(); iter != summaries.end() && root != nullptr; ++iter) {
+        auto node = findPointer(root, *iter);
+        auto packed = node != nullptr && node->Kind() == JTokenKind::ArrayToken ? dynamic_cast<JArray *>(node)->Packed : nullptr;
+        if (packed == nullptr) {
+            std::cerr << "No array of only numbers at '" << *iter << "'" << std::endl;
+            return 1;
+        }
+        std::cout << "'" << *iter << "': " << packed->Size() << (packed->IsDouble() ? " double" : " int64") << " numbers, sum ";
+        int64_t sum;
+        if (packed->IsDouble() || packed->Size() == 0) {
+            std::cout << packed->Sum() << ", min " << packed->Min() << ", max " << packed->Max() << std::endl;
+        }
+        else if (packed->IntegerSum(sum)) {
+            std::cout << sum << ", min " << packed->IntegerMin() << ", max " << packed->IntegerMax() << std::endl;
+        }
+        else {
+            std::cout << packed->Sum() << " (overflows int64), min " << packed->IntegerMin() << ", max " << packed->IntegerMax() << std::endl;
+        }
+    }
+    std::cout.precision(precision);
+
+    if (roundtrip && root != nullptr) {
+        for (auto iter = sets.begin(); iter != sets.end(); ++iter) {
+            if (!applySet(root, *iter)) return 1;
+        }
+        if (!noprint) writeDocument(std::cout, root, source.Data(), source.Length());
+    }
+    else if (!noprint && summaries.empty() && root != nullptr) {
+        auto printStart = std::chrono::high_resolution_clock::now();
+        if (!printDocument(root, printThreads, STDOUT_FILENO)) return 1;
+        auto printEnd = std::chrono::high_resolution_clock::now();
+        if (bench) {
+            std::cout
+                << "Printing on " << printThreads << " threads Completed in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(printEnd - printStart).count()
+                << "ms."
+                << std::endl;
+        }
+    }
+
+    if (bench) {
+        std::cout
+            << "Parsing '" << filename << "' Completed in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+            << "ms."
+            << std::endl;
+    }
+    if (bench || stats) {
+        input.PrintStats(std::cout);
+    }
+
+    delete root;
+
+    return 0;
+}
+#endif
+
+ParseState *beginParse(size_t offset){
+    position = offset;
+    tokenLength = 0;
+    parseFailed = false;
+    return ignoreWhitespace(beginToken());
+}
+
+ParseState *feed(ParseState *state, const char *data, size_t length){
+    for (size_t i = 0; i < length; i++, position++) {
+        auto next = ((*state)(data[i]));
+        delete state;
+        state = next;
+    }
+    return state;
+}
+
+JToken *endParse(ParseState *state){
+    // A number only ends on the character after it, so one running up to
+    // the end of the input needs a nudge. Whitespace ends any token but a
+    // string, and an unterminated string is still reported below.
+    state = feed(state, " ", 1);
+    delete state;
+
+    JToken *root = nullptr;
+    if (nodes.size() > 1 || tokens.size() > 0) {
+        if (reportErrors) std::cerr << "Unexpected EOF" << std::endl;
+        parseFailed = true;
+    }
+    else if (!nodes.empty()) {
+        root = nodes.top();
+        nodes.pop();
+    }
+
+    while (!nodes.empty()){
+        if (nodes.top() != nullptr) {
+            delete nodes.top();
+        }
+        nodes.pop();
+    };
+
+    while (!tokens.empty()){
+        if (tokens.top() != nullptr) {
+            delete tokens.top();
+        }
+        tokens.pop();
+    };
+
+    while (!nodeKinds.empty()){
+        nodeKinds.pop();
+    }
+
+    while (!packedRuns.empty()){
+        delete packedRuns.top();
+        packedRuns.pop();
+    }
+    token.str("");
+    token.clear();
+    tokenLength = 0;
+
+    return root;
+}
+
+JToken *parseDocument(const char *data, size_t length){
+    return endParse(feed(beginParse(), data, length));
+}
+
+ParseState *beginToken(){
     return new ParseState([](char c) {
-        if (c == ':')
+        if (std::isdigit(c)) {
+            nodeKinds.push(JTokenKind::NumberToken);
+            tokens.push(nullptr);// leading sign
+            append(c);
+            if (!AllowSuperfluousLeadingZeroes && c == '0') {
+                emit(TokenKind::Integer);
+                return parseOptionalDecimal();
+            }
+            return parseInteger();
+        }
+        switch (c) {
+            case '{':
+                nodeKinds.push(JTokenKind::ObjectToken);
+                append(c);
+                emit(TokenKind::LeftCBracket);
+                return ignoreWhitespace(parseObjectPropertyOrEnd());
+            case '[':
+                nodeKinds.push(JTokenKind::ArrayToken);
+                append(c);
+                emit(TokenKind::LeftSQBracket);
+                return ignoreWhitespace(parseTokenOrArrayEnd());
+            case '"':
+                nodeKinds.push(JTokenKind::StringToken);
+                append(c);
+                emit(TokenKind::DoubleQuote);
+                return parseString();
+            case '-':
+                nodeKinds.push(JTokenKind::NumberToken);
+                append(c);
+                emit(TokenKind::Sign);
+                return parseIntegerStart();
+            case 't':
+                nodeKinds.push(JTokenKind::LiteralToken);
+                return unpeek(readLiteral("true", TokenKind::TrueLiteral), c);
+            case 'f':
+                nodeKinds.push(JTokenKind::LiteralToken);
+                return unpeek(readLiteral("false", TokenKind::FalseLiteral), c);
+            case 'n':
+                nodeKinds.push(JTokenKind::LiteralToken);
+                return unpeek(readLiteral("null", TokenKind::NullLiteral), c);
+            }
+        return error("Expected beginning of token.");
+    });
+}
+
+ParseState *parseObjectPropertyOrEnd(){
+    return new ParseState([](char c) { 
+        switch (c)
+        {
+        case '"':
+            nodeKinds.push(JTokenKind::PropertyToken);
+            nodeKinds.push(JTokenKind::PropertyNameToken);
+            append(c);
+            emit(TokenKind::DoubleQuote);
+            return parseString();
+        }
+        return unpeek(parseObjectEnd(), c);// Or End
+    });
+}
+
+ParseState *parseObjectPropertyRequired(){
+    return new ParseState([](char c) { 
+        switch (c)
+        {
+        case '"':
+            nodeKinds.push(JTokenKind::PropertyToken);
+            nodeKinds.push(JTokenKind::PropertyNameToken);
+            append(c);
+            emit(TokenKind::DoubleQuote);
+            return parseString();
+        }
+        return expectedInput("'\"'", c);
+    });
+}
+
+ParseState *parseObjectEnd(){
+    return new ParseState([](char c) { 
+        switch (c)
+        {
+        case '}':
+            append(c);
+            emit(TokenKind::LeftCBracket);
+            return pushNode();
+        }
+        return expectedInput("'}' or ','", c);
+    });
+}
+
+ParseState *parseString(){// TODO JOSH, parse escapes
+    return new ParseState([](char c) {
+        switch (c)
+        {
+        case '"':
+            emit(TokenKind::String);
+            append(c);
+            emit(TokenKind::DoubleQuote);
+            return pushNode();
+        }
+        append(c);
+        return parseString();
+    });
+}
+
+ParseState *parsePropertyValue() {
+    return new ParseState([](char c) {
+        if (c == ':')
+        {
+            append(c);
+            emit(TokenKind::Colon);
+            return ignoreWhitespace(beginToken());
+        }
+
+        return error("Expected :");
+    });
+}
+
+ParseState *parseIntegerStart() {
+    if (AllowSuperfluousLeadingZeroes){
+        return parseInteger();
+    }
+    return new ParseState([](char c) { 
+        if (c == '0')
+        {
+            append(c);
+            emit(TokenKind::Integer);
+            return parseOptionalDecimal();
+        }
+        if (std::isdigit(c))
+        {
+            append(c);
+            return parseInteger();
+        }
+        return expectedInput("digit", c);
+    });
+}
+
+ParseState *parseInteger() {
+    return new ParseState([](char c) { 
+        if (std::isdigit(c))
+        {
+            append(c);
+            return parseInteger();
+        }
+        emit(TokenKind::Integer);
+        return unpeek(parseOptionalDecimal(), c);
+    });
+}
+
+ParseState *parseOptionalDecimal() {
+    return new ParseState([](char c) { 
+        if (c == '.')
+        {
+            append(c);
+            emit(TokenKind::DecimalPoint);
+            return parseFractionalIntegerStart();
+        }
+        tokens.push(nullptr);// .
+        tokens.push(nullptr);// XXX
+        return unpeek(parseOptionalExp(), c);
+    });
+}
+
+ParseState *parseFractionalIntegerStart() {
+    return new ParseState([](char c) { 
+        if (std::isdigit(c))
+        {
+            append(c);
+            return parseFractionalInteger();
+        }
+        return expectedInput("digit", c);
+    });
+}
+
+ParseState *parseFractionalInteger() {
+    return new ParseState([](char c) { 
+        if (std::isdigit(c))
+        {
+            append(c);
+            return parseFractionalInteger();
+        }
+        emit(TokenKind::Integer);
+        return unpeek(parseOptionalExp(), c);
+    });
+}
+
+ParseState *parseOptionalExp() {
+    return new ParseState([](char c) { 
+        if (c == 'e' || c == 'E')
+        {
+            append(c);
+            emit(TokenKind::Exp);
+            return parseOptionalExpSign();
+        }
+        tokens.push(nullptr);// e
+        tokens.push(nullptr);// +/-
+        tokens.push(nullptr);// XXX
+        return unpeek(pushNode(), c);
+    });
+}
+
+ParseState *parseOptionalExpSign() {
+    return new ParseState([](char c) { 
+        if (c == '-' || c == '+')
+        {
+            append(c);
+            emit(TokenKind::Sign);
+            return parseExpIntegerStart();
+        }
+        tokens.push(nullptr);// +/-
+        return unpeek(parseExpIntegerStart(), c);
+    });
+}
+
+ParseState *parseExpIntegerStart() {
+    return new ParseState([](char c) { 
+        if (std::isdigit(c))
+        {
+            append(c);
+            return parseExpInteger();
+        }
+        return expectedInput("digit", c);
+    });
+}
+
+ParseState *parseExpInteger() {
+    return new ParseState([](char c) { 
+        if (std::isdigit(c))
+        {
+            append(c);
+            return parseExpInteger();
+        }
+        emit(TokenKind::Integer);
+        return unpeek(pushNode(), c);
+    });
+}
+
+JToken *spanned(JToken *node, size_t begin, size_t end){
+    node->Begin = begin;
+    node->End = end;
+    node->Spanned = true;
+    return node;
+}
+
+// Moves a node within its parent, children move along with it
+void shiftSpan(JToken *node, ptrdiff_t delta){
+    node->Begin += delta;
+    node->End += delta;
+    switch (node->Kind()) {
+    case JTokenKind::ObjectToken:
+        dynamic_cast<JObject *>(node)->ContentEnd += delta;
+        break;
+    case JTokenKind::ArrayToken:
+        dynamic_cast<JArray *>(node)->ContentEnd += delta;
+        break;
+    case JTokenKind::PropertyToken:
+        dynamic_cast<JProperty *>(node)->ValueBegin += delta;
+        dynamic_cast<JProperty *>(node)->ValueEnd += delta;
+        break;
+    case JTokenKind::ArrayElementToken:
+        dynamic_cast<JArrayElement *>(node)->ValueBegin += delta;
+        dynamic_cast<JArrayElement *>(node)->ValueEnd += delta;
+        break;
+    default:
+        break;
+    }
+}
+
+// Applies a container's pending sibling moves to the children themselves,
+// before children are added or removed
+void settleShifts(JToken *container){
+    if (container->Kind() == JTokenKind::ObjectToken) {
+        auto object = dynamic_cast<JObject *>(container);
+        for (size_t i = 0; i < object->Properties->size() && !object->Shifts.Empty(); i++) {
+            shiftSpan((*object->Properties)[i], object->Shifts.At(i));
+        }
+        object->Shifts.Clear();
+    }
+    else if (container->Kind() == JTokenKind::ArrayToken) {
+        auto array = dynamic_cast<JArray *>(container);
+        for (size_t i = 0; i < array->Values->size() && !array->Shifts.Empty(); i++) {
+            shiftSpan((*array->Values)[i], array->Shifts.At(i));
+        }
+        array->Shifts.Clear();
+    }
+}
+
+size_t tokenEnd(Token *token){
+    return token->Offset + token->StringValue.length();
+}
+
+// Where the whitespace before a property or element starts: after the
+// previous sibling, or after the bracket if it is the first one
+size_t leadingWhitespaceBegin(){
+    auto begin = tokens.top()->Offset + 1;
+    return nodes.empty() ? begin : std::max(begin, nodes.top()->End);
+}
+
+// Splits a number as the parse states would have tokenized it
+JNumber *numberFromText(const std::string &text, size_t begin){
+    size_t i = 0;
+    auto part = [&](TokenKind kind, const char *chars) -> Token * {
+        auto length = std::min(text.find_first_not_of(chars, i), text.length()) - i;
+        if (length == 0) return nullptr;
+        auto token = new Token(kind, text.substr(i, length), begin + i);
+        i += length;
+        return token;
+    };
+    auto sign = part(TokenKind::Sign, "-");
+    auto integer = part(TokenKind::Integer, "0123456789");
+    auto period = part(TokenKind::DecimalPoint, ".");
+    auto fraction = period != nullptr ? part(TokenKind::Integer, "0123456789") : nullptr;
+    auto exp = part(TokenKind::Exp, "eE");
+    auto expSign = exp != nullptr ? part(TokenKind::Sign, "+-") : nullptr;
+    auto expInteger = exp != nullptr ? part(TokenKind::Integer, "0123456789") : nullptr;
+    return new JNumber(sign, integer, period, fraction, exp, expSign, expInteger);
+}
+
+template <typename T>
+static std::string shortestSpelling(T value){
+    char buffer[32];
+    return std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+}
+
+std::string PackedNumbers::Spelling(size_t index){
+    auto found = std::lower_bound(spellings.begin(), spellings.end(), std::make_pair((uint32_t)index, (uint32_t)0));
+    if (found != spellings.end() && found->first == index) {
+        auto begin = found == spellings.begin() ? 0 : (found - 1)->second;
+        return spellingText.substr(begin, found->second - begin);
+    }
+    return isDouble ? shortestSpelling(doubles[index]) : shortestSpelling(integers[index]);
+}
+
+// Folds values in four independent lanes, so the loop vectorizes
+template <typename T, typename R, typename F>
+static R reduceLanes(const std::vector<T> &values, R initial, F combine){
+    R lanes[4] = {initial, initial, initial, initial};
+    size_t i = 0;
+    for (; i + 4 <= values.size(); i += 4) {
+        lanes[0] = combine(lanes[0], values[i]);
+        lanes[1] = combine(lanes[1], values[i + 1]);
+        lanes[2] = combine(lanes[2], values[i + 2]);
+        lanes[3] = combine(lanes[3], values[i + 3]);
+    }
+    for (; i < values.size(); i++) lanes[0] = combine(lanes[0], values[i]);
+    return combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+}
+
+// Sums in __int128 lanes, which can't overflow, and checks the total fits
+static bool sumIntegers(const std::vector<int64_t> &values, int64_t &sum){
+    auto total = reduceLanes(values, (__int128)0, [](__int128 sum, __int128 value) { return sum + value; });
+    if (total < INT64_MIN || total > INT64_MAX) return false;
+    sum = (int64_t)total;
+    return true;
+}
+
+double PackedNumbers::Sum(){
+    auto add = [](double sum, double value) { return sum + value; };
+    return isDouble ? reduceLanes(doubles, 0.0, add) : reduceLanes(integers, 0.0, add);
+}
+
+double PackedNumbers::Min(){
+    if (Size() == 0) return std::numeric_limits<double>::quiet_NaN();
+    auto min = [](double a, double b) { return b < a ? b : a; };
+    return isDouble ? reduceLanes(doubles, doubles[0], min) : reduceLanes(integers, (double)integers[0], min);
+}
+
+double PackedNumbers::Max(){
+    if (Size() == 0) return std::numeric_limits<double>::quiet_NaN();
+    auto max = [](double a, double b) { return b > a ? b : a; };
+    return isDouble ? reduceLanes(doubles, doubles[0], max) : reduceLanes(integers, (double)integers[0], max);
+}
+
+bool PackedNumbers::IntegerSum(int64_t &sum){
+    return sumIntegers(integers, sum);
+}
+
+int64_t PackedNumbers::IntegerMin(){
+    return reduceLanes(integers, integers[0], [](int64_t a, int64_t b) { return b < a ? b : a; });
+}
+
+int64_t PackedNumbers::IntegerMax(){
+    return reduceLanes(integers, integers[0], [](int64_t a, int64_t b) { return b > a ? b : a; });
+}
+
+bool PackedNumbers::Push(const std::string &text, size_t valueBegin, size_t end){
+    if (end - Origin > UINT32_MAX) return false;
+    auto first = text.data();
+    auto last = first + text.length();
+
+    int64_t integer;
+    if (!isDouble && std::from_chars(first, last, integer).ptr == last && shortestSpelling(integer) == text) {
+        integers.push_back(integer);
+    }
+    else {
+        double value;
+        auto parsed = std::from_chars(first, last, value);
+        if (parsed.ec != std::errc() || parsed.ptr != last) return false;// Out of double range
+        if (!isDouble) {
+            // Promote, keeping the spelling of integers that print differently as doubles
+            doubles.reserve(std::max(integers.capacity(), integers.size() + 1));
+            for (size_t i = 0; i < integers.size(); i++) {
+                doubles.push_back((double)integers[i]);
+                auto spelling = shortestSpelling(integers[i]);
+                if (shortestSpelling(doubles.back()) != spelling) {
+                    spellingText += spelling;
+                    spellings.push_back(std::make_pair((uint32_t)i, (uint32_t)spellingText.length()));
+                }
+            }
+            std::vector<int64_t>().swap(integers);
+            isDouble = true;
+        }
+        doubles.push_back(value);
+        if (shortestSpelling(value) != text) {
+            spellingText += text;
+            spellings.push_back(std::make_pair((uint32_t)(doubles.size() - 1), (uint32_t)spellingText.length()));
+        }
+    }
+    valueBegins.push_back(valueBegin - Origin);
+    ends.push_back(end - Origin);
+    return true;
+}
+
+void PackedNumbers::Shrink(){
+    integers.shrink_to_fit();
+    doubles.shrink_to_fit();
+    valueBegins.shrink_to_fit();
+    ends.shrink_to_fit();
+    spellingText.shrink_to_fit();
+    spellings.shrink_to_fit();
+}
+
+std::vector<JArrayElement *> *PackedNumbers::Box(size_t origin){
+    auto elements = new std::vector<JArrayElement *>();
+    elements->reserve(Size());
+    for (size_t i = 0; i < Size(); i++) {
+        auto text = Spelling(i);
+        size_t begin = origin + (i == 0 ? 1 : ends[i - 1]);
+        size_t valueBegin = origin + valueBegins[i];
+        size_t valueEnd = valueBegin + text.length();
+        size_t end = origin + ends[i];
+        auto value = spanned(numberFromText(text, valueBegin), valueBegin - begin, valueEnd - begin);
+        auto element = new JArrayElement(value, end > valueEnd ? new Token(TokenKind::Comma, ",", end - 1) : nullptr);
+        value->Parent = element;
+        element->ValueBegin = valueBegin;
+        element->ValueEnd = valueEnd;
+        elements->push_back(dynamic_cast<JArrayElement *>(spanned(element, begin, end)));
+    }
+    return elements;
+}
+
+ParseState *pushNode(){
+    auto kind = nodeKinds.top();
+    nodeKinds.pop();
+    bool hadTrailingComma = false;
+    switch (kind)
+    {
+    case JTokenKind::LiteralToken:
+    {
+        auto value = tokens.top(); tokens.pop();
+        nodes.push(spanned(new JLiteral(value), value->Offset, tokenEnd(value)));
+        break;
+    }
+    case JTokenKind::NumberToken:
+    {
+        auto expPart = tokens.top(); tokens.pop();
+        auto expSign = tokens.top(); tokens.pop();
+        auto exp = tokens.top(); tokens.pop();
+        auto fractionalPart = tokens.top(); tokens.pop();
+        auto decimal = tokens.top(); tokens.pop();
+        auto wholePart = tokens.top(); tokens.pop();
+        auto leadingMinus =   tokens.top(); tokens.pop();
+
+        nodes.push(spanned(
+            new JNumber(leadingMinus, wholePart, decimal, fractionalPart, exp, expSign, expPart),
+            (leadingMinus != nullptr ? leadingMinus : wholePart)->Offset,
+            tokenEnd(expPart != nullptr ? expPart : fractionalPart != nullptr ? fractionalPart : wholePart)));
+        break;
+    }
+    case JTokenKind::ObjectToken:
+    {
+        auto end = tokens.top(); tokens.pop();
+        auto props = new std::vector<JProperty *>();
+        while (!nodes.empty())
+        {
+            if (nodes.top()->Kind() == JTokenKind::PropertyToken){
+                props->push_back(dynamic_cast<JProperty *>(nodes.top()));
+                nodes.pop();
+            }
+            else {
+                break;
+            }
+        }
+        std::reverse(props->begin(), props->end());
+        auto begin = tokens.top(); tokens.pop();
+        auto object = new JObject(begin, props, end);
+        object->ContentEnd = props->empty() ? begin->Offset + 1 : props->back()->End;
+        for (auto iter = props->begin(); iter != props->end(); ++iter) {
+            (*iter)->Parent = object;
+            shiftSpan(*iter, -(ptrdiff_t)begin->Offset);
+        }
+        nodes.push(spanned(object, begin->Offset, end->Offset + 1));
+        break;
+    }
+    case JTokenKind::ArrayToken:
+    {
+        auto end = tokens.top(); tokens.pop();
+        auto elems = new std::vector<JArrayElement *>();
+        PackedNumbers *packed = nullptr;
+        if (!packedRuns.empty() && packedRuns.top()->Origin == tokens.top()->Offset) {
+            packed = packedRuns.top(); packedRuns.pop();
+            packed->Shrink();
+        }
+        while (!nodes.empty())
+        {
+            // Stop at the '[': the enclosing array's elements are right below
+            // an empty or packed one
+            if (nodes.top()->Kind() == JTokenKind::ArrayElementToken && nodes.top()->Begin > tokens.top()->Offset){
+                elems->push_back(dynamic_cast<JArrayElement *>(nodes.top()));
+                nodes.pop();
+            }
+            else {
+                break;
+            }
+        }
+        std::reverse(elems->begin(), elems->end());
+        auto begin = tokens.top(); tokens.pop();
+        auto array = new JArray(begin, elems, end);
+        array->Packed = packed;
+        array->ContentEnd = packed != nullptr ? begin->Offset + packed->ContentEnd()
+            : elems->empty() ? begin->Offset + 1 : elems->back()->End;
+        for (auto iter = elems->begin(); iter != elems->end(); ++iter) {
+            (*iter)->Parent = array;
+            shiftSpan(*iter, -(ptrdiff_t)begin->Offset);
+        }
+        nodes.push(spanned(array, begin->Offset, end->Offset + 1));
+        break;
+    }
+    case JTokenKind::ArrayElementToken:
+    {
+        auto trailing = tokens.top(); tokens.pop();
+        auto value = nodes.top(); nodes.pop();
+        hadTrailingComma = trailing != nullptr;
+
+        // Numbers go into the array's PackedNumbers for as long as nothing
+        // else turns up, then they are boxed like any other element
+        auto bracket = tokens.top()->Offset;
+        auto packed = !packedRuns.empty() && packedRuns.top()->Origin == bracket ? packedRuns.top() : nullptr;
+        bool first = packed == nullptr && (nodes.empty() || nodes.top()->End <= bracket);
+        if (value->Kind() == JTokenKind::NumberToken && (packed != nullptr || first)) {
+            auto run = packed != nullptr ? packed : new PackedNumbers(bracket);
+            if (run->Push(dynamic_cast<JNumber *>(value)->Text(), value->Begin, trailing != nullptr ? trailing->Offset + 1 : value->End)) {
+                if (run != packed) packedRuns.push(run);
+                delete value;
+                if (trailing != nullptr) delete trailing;
+                break;
+            }
+            if (run != packed) delete run;
+        }
+        if (packed != nullptr) {
+            auto boxed = packed->Box(bracket);
+            for (auto iter = boxed->begin(); iter != boxed->end(); ++iter) nodes.push(*iter);
+            delete boxed;
+            delete packed;
+            packedRuns.pop();
+        }
+
+        auto element = new JArrayElement(value, trailing);
+        value->Parent = element;
+        element->ValueBegin = value->Begin;
+        element->ValueEnd = value->End;
+        nodes.push(spanned(element, leadingWhitespaceBegin(), trailing != nullptr ? trailing->Offset + 1 : value->End));
+        shiftSpan(value, -(ptrdiff_t)element->Begin);
+        break;
+    }
+    case JTokenKind::StringToken:
+    case JTokenKind::PropertyNameToken:
+    {
+        auto end = tokens.top(); tokens.pop();
+        auto value = tokens.top(); tokens.pop();
+        auto start = tokens.top(); tokens.pop();
+        nodes.push(spanned(new JString(start, value, end), start->Offset, end->Offset + 1));
+        break;
+    }
+    case JTokenKind::PropertyToken:
+    {
+        auto trailingComma = tokens.top(); tokens.pop();
+        auto value = nodes.top(); nodes.pop();
+        auto colon = tokens.top(); tokens.pop();
+        auto name = dynamic_cast<JString*>(nodes.top()); nodes.pop();
+        auto property = new JProperty(name, colon, value, trailingComma);
+        name->Parent = property;
+        value->Parent = property;
+        property->ValueBegin = value->Begin;
+        property->ValueEnd = value->End;
+        nodes.push(spanned(property, leadingWhitespaceBegin(), trailingComma != nullptr ? trailingComma->Offset + 1 : value->End));
+        shiftSpan(name, -(ptrdiff_t)property->Begin);
+        shiftSpan(value, -(ptrdiff_t)property->Begin);
+        hadTrailingComma = trailingComma != nullptr;
+        break;
+    }
+    default:
+        std::cerr << "Could not push node " << kind << std::endl;
+        return ignoreInput();
+    }
+
+    if (nodeKinds.empty()){
+        return ignoreWhitespace(eof());
+    }
+
+    switch (nodeKinds.top()){
+    case JTokenKind::ObjectToken:
+        return ignoreWhitespace(hadTrailingComma 
+            ? (AllowTrailingCommas ? parseObjectPropertyOrEnd() : parseObjectPropertyRequired())
+            : parseObjectEnd());
+    case JTokenKind::PropertyToken:
+        return kind == JTokenKind::PropertyNameToken
+            ? ignoreWhitespace(parsePropertyValue()) // Name parsed, needs value
+            : ignoreWhitespace(parseOptionalComma());// Value parsed, but have not created the property
+    case JTokenKind::ArrayElementToken:
+        return ignoreWhitespace(parseOptionalComma());
+    case JTokenKind::ArrayToken:
+        if (!AllowTrailingCommas && hadTrailingComma){
+            nodeKinds.push(JTokenKind::ArrayElementToken);
+        }
+        return ignoreWhitespace(hadTrailingComma 
+            ? (AllowTrailingCommas ? parseTokenOrArrayEnd() : beginToken())
+            : parseArrayEnd());
+    }
+    std::cerr << "Could not continue after node " << nodeKinds.top() << std::endl;
+    return ignoreInput();
+}
+
+ParseState *parseOptionalComma(){
+    return new ParseState([](char c) { 
+        // either way, we're pushing the property, we're just getting the trailing comma first
+        if (c == ',')
+        {
+            append(c);
+            emit(TokenKind::Comma);
+            return pushNode();
+        }
+        tokens.push(nullptr);// ,
+        return unpeek(pushNode(), c);
+    });
+}
+
+ParseState *parseTokenOrArrayEnd(){
+    return new ParseState([](char c) { 
+        if (c == ']')
+        {
+            append(c);
+            emit(TokenKind::RightSQBracket);
+            return pushNode();
+        }
+        nodeKinds.push(JTokenKind::ArrayElementToken);
+        return unpeek(beginToken(), c);
+    });
+}
+
+ParseState *parseArrayEnd(){
+    return new ParseState([](char c) { 
+        if (c == ']')
+        {
+            append(c);
+            emit(TokenKind::RightSQBracket);
+            return pushNode();
+        }
+        return expectedInput("']' or ','", c);
+    });
+}
+
+ParseState *eof(){
+    return new ParseState([](char c) { return error("Expected end of file"); });
+}
+
+ParseState *error(std::string message){
+    parseFailed = true;
+    if (reportErrors) std::cerr << message << std::endl;
+    return ignoreInput();
+}
+
+ParseState *unexpectedInput(char c){
+    parseFailed = true;
+    if (reportErrors) std::cerr << "Unexpected Character '" << c << "'" << std::endl;
+    return ignoreInput();
+}
+
+ParseState *expectedInput(std::string expectedMessage, char c){
+    parseFailed = true;
+    if (reportErrors) std::cerr << "Expected input " << expectedMessage << " got '" << c << "'" << std::endl;
+    return ignoreInput();
+}
+
+ParseState *ignoreInput(){
+    return new ParseState([](char c) { return ignoreInput(); });
+}
+
+ParseState *ignoreWhitespace(ParseState *state){
+    return new ParseState([=](char c) {
+        if (std::isspace(c))
+        {
+            return ignoreWhitespace(state);
+        }
+        return unpeek(state, c);
+    });
+}
+
+ParseState *unpeek(ParseState * state, char c)
+{
+    auto next = (*state)(c);
+    delete state;
+    return next;
+}
+
+ParseState *readLiteral(std::string sequence, TokenKind literalKind)
+{
+    return new ParseState([=](char c) {
+        if (c == sequence[0])
+        {
+            append(c);
+            if (sequence.length() == 1)
+            {
+                emit(literalKind);
+                return pushNode();
+            }
+            return readLiteral(sequence.substr(1), literalKind);
+        }
+        return unexpectedInput(c);
+    });
+}
+
+bool cursorError(JsonCursor &cursor, const char *message)
+{
+    if (cursor.Error == nullptr) {
+        cursor.Error = cursor.Pos == cursor.End ? "Unexpected EOF" : message;
+    }
+    return false;
+}
+
+void skipWhitespace(JsonCursor &cursor)
+{
+    while (cursor.Pos < cursor.End && std::isspace((unsigned char)*cursor.Pos)) {
+        cursor.Pos++;
+    }
+}
+
+bool scanString(JsonCursor &cursor, const char **value, size_t *length)
+{
+    if (cursor.Pos == cursor.End || *cursor.Pos != '"') return cursorError(cursor, "Expected input '\"'");
+    auto start = ++cursor.Pos;
+    auto end = (const char *)std::memchr(start, '"', cursor.End - start);
+    if (end == nullptr) {
+        cursor.Pos = cursor.End;
+        return cursorError(cursor, "Unexpected EOF");
+    }
+    *value = start;
+    *length = end - start;
+    cursor.Pos = end + 1;
+    return true;
+}
+
+static bool scanDigits(JsonCursor &cursor)
+{
+    if (cursor.Pos == cursor.End || !std::isdigit((unsigned char)*cursor.Pos)) {
+        return cursorError(cursor, "Expected input digit");
+    }
+    while (cursor.Pos < cursor.End && std::isdigit((unsigned char)*cursor.Pos)) {
+        cursor.Pos++;
+    }
+    return true;
+}
+
+bool scanNumber(JsonCursor &cursor, const char **value, size_t *length, bool *isInteger)
+{
+    auto start = cursor.Pos;
+    if (cursor.Pos < cursor.End && *cursor.Pos == '-') cursor.Pos++;
+    if (!AllowSuperfluousLeadingZeroes && cursor.Pos < cursor.End && *cursor.Pos == '0') {
+        cursor.Pos++;
+    }
+    else if (!scanDigits(cursor)) {
+        return false;
+    }
+    *isInteger = true;
+    if (cursor.Pos < cursor.End && *cursor.Pos == '.') {
+        cursor.Pos++;
+        if (!scanDigits(cursor)) return false;
+        *isInteger = false;
+    }
+    if (cursor.Pos < cursor.End && (*cursor.Pos == 'e' || *cursor.Pos == 'E')) {
+        cursor.Pos++;
+        if (cursor.Pos < cursor.End && (*cursor.Pos == '-' || *cursor.Pos == '+')) cursor.Pos++;
+        if (!scanDigits(cursor)) return false;
+        *isInteger = false;
+    }
+    *value = start;
+    *length = cursor.Pos - start;
+    return true;
+}
+
+bool scanLiteral(JsonCursor &cursor, const char *sequence)
+{
+    for (; *sequence != '\0'; sequence++, cursor.Pos++) {
+        if (cursor.Pos == cursor.End || *cursor.Pos != *sequence) {
+            return cursorError(cursor, "Unexpected Character");
+        }
+    }
+    return true;
+}
+
+bool scanContainerBegin(JsonCursor &cursor, char bracket)
+{
+    if (cursor.Pos == cursor.End || *cursor.Pos != bracket) {
+        return cursorError(cursor, bracket == '{' ? "Expected input '{'" : "Expected input '['");
+    }
+    if (cursor.Depth >= MaxNestingDepth) return cursorError(cursor, "Maximum nesting depth exceeded");
+    cursor.Depth++;
+    cursor.Pos++;
+    return true;
+}
+
+// Skips the ',' between members (or the trailing one), consuming the closing
+// bracket instead when the container ends.
+static bool scanSeparator(JsonCursor &cursor, bool &first, char close)
+{
+    skipWhitespace(cursor);
+    if (cursor.Pos == cursor.End) return cursorError(cursor, "Unexpected EOF");
+    if (*cursor.Pos != close && !first) {
+        if (*cursor.Pos != ',') {
+            return cursorError(cursor, close == '}' ? "Expected input '}' or ','" : "Expected input ']' or ','");
+        }
+        cursor.Pos++;
+        skipWhitespace(cursor);
+        if (!AllowTrailingCommas) return true;// a closing bracket here fails as a missing value
+    }
+    if (cursor.Pos < cursor.End && *cursor.Pos == close) {
+        cursor.Pos++;
+        cursor.Depth--;
+        return false;
+    }
+    first = false;
+    return true;
+}
+
+// Positions the cursor on the next property's value, or consumes the '}' and
+// returns false (check cursor.Error to tell the two apart).
+bool scanNextProperty(JsonCursor &cursor, bool &first, const char **name, size_t *nameLength)
+{
+    if (!scanSeparator(cursor, first, '}')) return false;
+    if (!scanString(cursor, name, nameLength)) return false;
+    skipWhitespace(cursor);
+    if (cursor.Pos == cursor.End || *cursor.Pos != ':') return cursorError(cursor, "Expected :");
+    cursor.Pos++;
+    skipWhitespace(cursor);
+    return true;
+}
+
+// Positions the cursor on the next element, or consumes the ']' and returns
+// false (check cursor.Error to tell the two apart).
+bool scanNextElement(JsonCursor &cursor, bool &first)
+{
+    return scanSeparator(cursor, first, ']');
+}
+
+bool skipValue(JsonCursor &cursor)
+{
+    const char *value;
+    size_t length;
+    bool isInteger;
+    bool first = true;
+    if (cursor.Pos == cursor.End) return cursorError(cursor, "Unexpected EOF");
+    switch (*cursor.Pos) {
+        case '{':
+            if (!scanContainerBegin(cursor, '{')) return false;
+            while (scanNextProperty(cursor, first, &value, &length)) {
+                if (!skipValue(cursor)) return false;
+            }
+            return cursor.Error == nullptr;
+        case '[':
+            if (!scanContainerBegin(cursor, '[')) return false;
+            while (scanNextElement(cursor, first)) {
+                if (!skipValue(cursor)) return false;
+            }
+            return cursor.Error == nullptr;
+        case '"':
+            return scanString(cursor, &value, &length);
+        case 't':
+            return scanLiteral(cursor, "true");
+        case 'f':
+            return scanLiteral(cursor, "false");
+        case 'n':
+            return scanLiteral(cursor, "null");
+    }
+    if (*cursor.Pos == '-' || std::isdigit((unsigned char)*cursor.Pos)) {
+        return scanNumber(cursor, &value, &length, &isInteger);
+    }
+    return cursorError(cursor, "Expected beginning of token.");
+}
+
+static void appendBit(std::vector<uint64_t> &bits, size_t index, bool value)
+{
+    if (index % 64 == 0) bits.push_back(0);
+    bits[index / 64] |= (uint64_t)value << (index % 64);
+}
+
+// The false, 0 or "" a null row holds in the column's values
+static void appendPlaceholder(Column &column, size_t row)
+{
+    switch (column.Kind) {
+    case BoolColumn:
+        appendBit(column.Bools, row, false);
+        break;
+    case IntegerColumn:
+        column.Integers.push_back(0);
+        break;
+    case DoubleColumn:
+        column.Doubles.push_back(0);
+        break;
+    case StringColumn:
+    case JsonColumn:
+        column.Offsets.push_back(column.Chars.length());
+        break;
+    default:
+        break;
+    }
+}
+
+static void appendNull(Column &column)
+{
+    appendPlaceholder(column, column.Rows);
+    appendBit(column.Validity, column.Rows, false);
+    column.NullCount++;
+    column.Rows++;
+}
+
+static void convertColumn(Column &column, ColumnKind kind)
+{
+    auto from = column.Kind;
+    column.Kind = kind;
+    if (from == NullColumn) {
+        if (kind == StringColumn || kind == JsonColumn) column.Offsets.push_back(0);
+        for (size_t row = 0; row < column.Rows; row++) appendPlaceholder(column, row);
+        return;
+    }
+    if (from == IntegerColumn && kind == DoubleColumn) {
+        column.Doubles.assign(column.Integers.begin(), column.Integers.end());
+        std::vector<int64_t>().swap(column.Integers);
+        return;
+    }
+
+    // Everything else ends up as JSON text
+    std::string chars;
+    std::vector<size_t> offsets(1, 0);
+    offsets.reserve(column.Rows + 1);
+    for (size_t row = 0; row < column.Rows; row++) {
+        if (column.IsValid(row)) {
+            switch (from) {
+            case BoolColumn:
+                chars += column.Bool(row) ? "true" : "false";
+                break;
+            case IntegerColumn:
+                chars += shortestSpelling(column.Integers[row]);
+                break;
+            case DoubleColumn:
+                chars += shortestSpelling(column.Doubles[row]);
+                break;
+            case StringColumn:
+                chars += '"' + column.Text(row) + '"';
+                break;
+            default:
+                break;
+            }
+        }
+        offsets.push_back(chars.length());
+    }
+    column.Chars.swap(chars);
+    column.Offsets.swap(offsets);
+    std::vector<uint64_t>().swap(column.Bools);
+    std::vector<int64_t>().swap(column.Integers);
+    std::vector<double>().swap(column.Doubles);
+}
+
+static bool appendValue(JsonCursor &cursor, Column &column)
+{
+    if (cursor.Pos == cursor.End) return cursorError(cursor, "Unexpected EOF");
+    auto start = cursor.Pos;
+    const char *value;
+    size_t length;
+    int64_t integer = 0;
+    double number = 0;
+    ColumnKind kind;
+    switch (*start) {
+    case 'n':
+        if (!scanLiteral(cursor, "null")) return false;
+        appendNull(column);
+        return true;
+    case 't':
+    case 'f':
+        if (!scanLiteral(cursor, *start == 't' ? "true" : "false")) return false;
+        kind = BoolColumn;
+        break;
+    case '"':
+        if (!scanString(cursor, &value, &length)) return false;
+        kind = StringColumn;
+        break;
+    case '{':
+    case '[':
+        if (!skipValue(cursor)) return false;
+        kind = JsonColumn;
+        break;
+    default:
+        bool isInteger;
+        if (*start != '-' && !std::isdigit((unsigned char)*start)) return cursorError(cursor, "Expected beginning of token.");
+        if (!scanNumber(cursor, &value, &length, &isInteger)) return false;
+        if (isInteger && !(value[0] == '-' && value[1] == '0') && std::from_chars(value, value + length, integer).ec == std::errc()) {
+            kind = IntegerColumn;
+        }
+        else {
+            kind = std::from_chars(value, value + length, number).ec == std::errc() ? DoubleColumn : JsonColumn;
+        }
+        break;
+    }
+
+    if (kind != column.Kind) {
+        bool numeric = (column.Kind == IntegerColumn || column.Kind == DoubleColumn) && (kind == IntegerColumn || kind == DoubleColumn);
+        auto target = column.Kind == NullColumn ? kind : numeric ? DoubleColumn : JsonColumn;
+        if (target != column.Kind) convertColumn(column, target);
+    }
+    switch (column.Kind) {
+    case BoolColumn:
+        appendBit(column.Bools, column.Rows, *start == 't');
+        break;
+    case IntegerColumn:
+        column.Integers.push_back(integer);
+        break;
+    case DoubleColumn:
+        column.Doubles.push_back(kind == IntegerColumn ? (double)integer : number);
+        break;
+    case StringColumn:
+        column.Chars.append(value, length);
+        column.Offsets.push_back(column.Chars.length());
+        break;
+    default:
+        column.Chars.append(start, cursor.Pos - start);
+        column.Offsets.push_back(column.Chars.length());
+        break;
+    }
+    appendBit(column.Validity, column.Rows, true);
+    column.Rows++;
+    return true;
+}
+
+static bool extractRecord(JsonCursor &cursor, ColumnTable &table, std::unordered_map<std::string, size_t> &columnIndex, JsonBindError &error)
+{
+    if (cursor.Pos == cursor.End || *cursor.Pos != '{') return bindMismatch(cursor, error, "object");
+    if (!scanContainerBegin(cursor, '{')) return false;
+    auto &columns = table.Columns;
+    bool first = true;
+    const char *name;
+    size_t nameLength;
+    size_t next = 0;// Records mostly repeat the key order, so the column after the last one is tried before the map
+    while (scanNextProperty(cursor, first, &name, &nameLength)) {
+        size_t index = next;
+        if (index >= columns.size() || columns[index].Name.compare(0, std::string::npos, name, nameLength) != 0) {
+            auto key = std::string(name, nameLength);
+            auto found = columnIndex.find(key);
+            if (found != columnIndex.end()) {
+                index = found->second;
+            }
+            else {
+                index = columns.size();
+                columnIndex.emplace(key, index);
+                columns.emplace_back();
+                columns.back().Name = key;
+                while (columns.back().Rows < table.Rows) appendNull(columns.back());
+            }
+        }
+        next = index + 1;
+        auto &column = columns[index];
+        if (!(column.Rows > table.Rows ? skipValue(cursor) : appendValue(cursor, column))) {
+            error.Path.insert(0, "." + column.Name);
+            return false;
+        }
+    }
+    if (cursor.Error != nullptr) return false;
+    for (auto iter = columns.begin(); iter != columns.end(); ++iter) {
+        if (iter->Rows == table.Rows) appendNull(*iter);
+    }
+    table.Rows++;
+    return true;
+}
+
+bool extractColumns(const char *data, size_t length, ColumnTable &table, JsonBindError &error)
+{
+    JsonCursor cursor(data, length);
+    std::unordered_map<std::string, size_t> columnIndex;
+    table = ColumnTable();
+    error.Path.clear();
+    error.Message.clear();
+    skipWhitespace(cursor);
+    bool extracted = false;
+    if (cursor.Pos == cursor.End || *cursor.Pos != '[') {
+        bindMismatch(cursor, error, "array of objects");
+    }
+    else if (scanContainerBegin(cursor, '[')) {
+        bool first = true;
+        extracted = true;
+        while (extracted && scanNextElement(cursor, first)) {
+            extracted = extractRecord(cursor, table, columnIndex, error);
+            if (!extracted) error.Path.insert(0, "[" + std::to_string(table.Rows) + "]");
+        }
+        extracted = extracted && cursor.Error == nullptr;
+        if (extracted) {
+            skipWhitespace(cursor);
+            if (cursor.Pos != cursor.End) extracted = cursorError(cursor, "Expected end of file");
+        }
+    }
+    if (!extracted) {
+        if (cursor.Error != nullptr) error.Message = cursor.Error;
+        error.Path.insert(0, "$");
+        error.Offset = cursor.Pos - cursor.Begin;
+    }
+    return extracted;
+}
+
+static void printSum(std::ostream &out, const std::vector<double> &values)
+{
+    out << reduceLanes(values, 0.0, [](double sum, double value) { return sum + value; });
+}
+
+static void printSum(std::ostream &out, const std::vector<int64_t> &values)
+{
+    int64_t sum;
+    if (sumIntegers(values, sum)) out << sum;
+    else out << reduceLanes(values, 0.0, [](double sum, double value) { return sum + value; }) << " (overflows int64)";
+}
+
+// Reduced in T, so int64 columns stay exact past 2^53
+template <typename T>
+static void printAggregates(std::ostream &out, Column &column, const std::vector<T> &values)
+{
+    bool any = false;
+    T min = 0;
+    T max = 0;
+    if (column.NullCount == 0 && !values.empty()) {
+        any = true;
+        min = reduceLanes(values, values[0], [](T a, T b) { return b < a ? b : a; });
+        max = reduceLanes(values, values[0], [](T a, T b) { return b > a ? b : a; });
+    }
+    else {
+        for (size_t row = 0; row < column.Rows; row++) {
+            if (!column.IsValid(row)) continue;
+            if (!any || values[row] < min) min = values[row];
+            if (!any || values[row] > max) max = values[row];
+            any = true;
+        }
+    }
+    // Null rows hold 0, so they don't need skipping here
+    out << ", sum ";
+    printSum(out, values);
+    if (any) out << ", min " << min << ", max " << max;
+    else out << ", min " << std::numeric_limits<double>::quiet_NaN() << ", max " << std::numeric_limits<double>::quiet_NaN();
+}
+
+void printColumns(std::ostream &out, ColumnTable &table)
+{
+    static const char *kindNames[] = {"null", "bool", "int64", "double", "string", "json"};
+    auto precision = out.precision(std::numeric_limits<double>::max_digits10);
+    out << "Rows: " << table.Rows << std::endl;
+    for (auto iter = table.Columns.begin(); iter != table.Columns.end(); ++iter) {
+        out << "Column '" << iter->Name << "': " << kindNames[iter->Kind] << ", " << iter->NullCount << " nulls";
+        switch (iter->Kind) {
+        case BoolColumn:
         {
-            token << c;
-            emit(TokenKind::Colon);
-            return ignoreWhitespace(beginToken());
+            size_t trueCount = 0;
+            for (auto word = iter->Bools.begin(); word != iter->Bools.end(); ++word) trueCount += __builtin_popcountll(*word);
+            out << ", " << trueCount << " true";
+            break;
+        }
+        case IntegerColumn:
+            printAggregates(out, *iter, iter->Integers);
+            break;
+        case DoubleColumn:
+            printAggregates(out, *iter, iter->Doubles);
+            break;
+        case StringColumn:
+        case JsonColumn:
+            out << ", " << iter->Chars.length() << " bytes";
+            break;
+        default:
+            break;
+        }
+        out << std::endl;
+    }
+    out.precision(precision);
+}
+
+Validator::Validator()
+{
+    Error = nullptr;
+    ErrorOffset = 0;
+    ErrorLine = 0;
+    ErrorColumn = 0;
+    state = State::Value;
+    literal = nullptr;
+    depth = 0;
+    offset = 0;
+    line = 0;
+    lineStart = 0;
+}
+
+bool Validator::fail(const char *message, const char *data, const char *at)
+{
+    Error = message;
+    ErrorOffset = offset + (at - data);
+    ErrorLine = line + std::count(data, at, '\n') + 1;
+    for (auto p = at; p > data; p--) {
+        if (p[-1] == '\n') {
+            lineStart = offset + (p - data);
+            break;
+        }
+    }
+    ErrorColumn = ErrorOffset - lineStart + 1;
+    state = State::Failed;
+    return false;
+}
+
+bool Validator::Feed(const char *data, size_t length)
+{
+    if (state == State::Failed) return false;
+    const char *p = data;
+    const char *end = data + length;
+    while (p < end) {
+        char c = *p;
+        if (std::isspace((unsigned char)c)) {
+            switch (state) {
+                case State::Value:
+                case State::ValueOrArrayEnd:
+                case State::PropertyOrObjectEnd:
+                case State::PropertyRequired:
+                case State::PropertyColon:
+                case State::AfterValue:
+                case State::Done:
+                    p++;
+                    continue;
+                default:
+                    break;
+            }
+        }
+        switch (state) {
+            case State::ValueOrArrayEnd:
+                if (c == ']') {
+                    depth--;
+                    state = State::AfterValue;
+                    p++;
+                    break;
+                }
+                state = State::Value;
+                break;
+            case State::Value:
+                if (c == '{' || c == '[') {
+                    if (depth == MaxNestingDepth) return fail("Maximum nesting depth exceeded", data, p);
+                    auto bit = uint64_t(1) << (depth % 64);
+                    containers[depth / 64] = c == '{' ? containers[depth / 64] | bit : containers[depth / 64] & ~bit;
+                    depth++;
+                    state = c == '{' ? State::PropertyOrObjectEnd : State::ValueOrArrayEnd;
+                }
+                else if (c == '"') state = State::StringValue;
+                else if (c == '-') state = State::NumberIntegerStart;
+                else if (c == '0' && !AllowSuperfluousLeadingZeroes) state = State::NumberAfterZero;
+                else if (std::isdigit((unsigned char)c)) state = State::NumberInteger;
+                else if (c == 't') literal = "rue", state = State::Literal;
+                else if (c == 'f') literal = "alse", state = State::Literal;
+                else if (c == 'n') literal = "ull", state = State::Literal;
+                else return fail("Expected beginning of token.", data, p);
+                p++;
+                break;
+            case State::PropertyRequired:
+                if (c == '}' && AllowTrailingCommas) {
+                    depth--;
+                    state = State::AfterValue;
+                    p++;
+                    break;
+                }
+                if (c != '"') return fail("Expected input '\"'", data, p);
+                state = State::PropertyName;
+                p++;
+                break;
+            case State::PropertyOrObjectEnd:
+                if (c == '}') {
+                    depth--;
+                    state = State::AfterValue;
+                }
+                else if (c == '"') state = State::PropertyName;
+                else return fail("Expected input '}' or ','", data, p);
+                p++;
+                break;
+            case State::PropertyName:
+            case State::StringValue:
+            {
+                auto quote = (const char *)std::memchr(p, '"', end - p);
+                if (quote == nullptr) {
+                    p = end;
+                    break;
+                }
+                state = state == State::PropertyName ? State::PropertyColon : State::AfterValue;
+                p = quote + 1;
+                break;
+            }
+            case State::PropertyColon:
+                if (c != ':') return fail("Expected :", data, p);
+                state = State::Value;
+                p++;
+                break;
+            case State::AfterValue:
+                if (depth == 0) {
+                    state = State::Done;
+                    break;
+                }
+                if (c == ',') {
+                    state = inObject()
+                        ? State::PropertyRequired
+                        : (AllowTrailingCommas ? State::ValueOrArrayEnd : State::Value);
+                }
+                else if (c == (inObject() ? '}' : ']')) depth--;
+                else return fail(inObject() ? "Expected input '}' or ','" : "Expected input ']' or ','", data, p);
+                p++;
+                break;
+            case State::NumberIntegerStart:
+                if (c == '0' && !AllowSuperfluousLeadingZeroes) state = State::NumberAfterZero;
+                else if (std::isdigit((unsigned char)c)) state = State::NumberInteger;
+                else return fail("Expected input digit", data, p);
+                p++;
+                break;
+            case State::NumberInteger:
+                while (p < end && std::isdigit((unsigned char)*p)) p++;
+                if (p < end) state = State::NumberAfterZero;
+                break;
+            case State::NumberAfterZero:
+                if (c == '.') state = State::NumberFractionStart;
+                else if (c == 'e' || c == 'E') state = State::NumberExpSign;
+                else {
+                    state = State::AfterValue;
+                    break;
+                }
+                p++;
+                break;
+            case State::NumberFractionStart:
+            case State::NumberExpStart:
+                if (!std::isdigit((unsigned char)c)) return fail("Expected input digit", data, p);
+                state = state == State::NumberFractionStart ? State::NumberFraction : State::NumberExp;
+                p++;
+                break;
+            case State::NumberFraction:
+                while (p < end && std::isdigit((unsigned char)*p)) p++;
+                if (p == end) break;
+                if (*p == 'e' || *p == 'E') {
+                    state = State::NumberExpSign;
+                    p++;
+                }
+                else state = State::AfterValue;
+                break;
+            case State::NumberExpSign:
+                if (c == '-' || c == '+') p++;
+                state = State::NumberExpStart;
+                break;
+            case State::NumberExp:
+                while (p < end && std::isdigit((unsigned char)*p)) p++;
+                if (p < end) state = State::AfterValue;
+                break;
+            case State::Literal:
+                if (c != *literal) return fail("Unexpected Character", data, p);
+                if (*++literal == '\0') state = State::AfterValue;
+                p++;
+                break;
+            case State::Done:
+                return fail("Expected end of file", data, p);
+            case State::Failed:
+                return false;
+        }
+    }
+    line += std::count(data, end, '\n');
+    for (auto q = end; q > data; q--) {
+        if (q[-1] == '\n') {
+            lineStart = offset + (q - data);
+            break;
+        }
+    }
+    offset += length;
+    return true;
+}
+
+bool Validator::Finish()
+{
+    switch (state) {
+        case State::NumberInteger:
+        case State::NumberAfterZero:
+        case State::NumberFraction:
+        case State::NumberExp:
+            state = State::AfterValue;
+            break;
+        case State::Failed:
+            return false;
+        default:
+            break;
+    }
+    if (state == State::AfterValue && depth == 0) state = State::Done;
+    if (state != State::Done) return fail("Unexpected EOF", nullptr, nullptr);
+    return true;
+}
+
+int validateFile(InputPipeline &input, const std::string &filename, bool bench, bool stats)
+{
+    Validator validator;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    bool valid = true;
+    const char *chunk;
+    size_t length;
+    while (valid && input.Next(chunk, length)) {
+        valid = validator.Feed(chunk, length);
+        input.Release();
+    }
+    if (!valid) {
+        input.Stop();// Stopped before the end, the reader may still be writing Error
+    }
+    else if (input.Error() != nullptr) {
+        std::cerr << "Could not read '" << filename << "': " << input.Error() << std::endl;
+        return 1;
+    }
+    valid = valid && validator.Finish();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if (!valid) {
+        std::cerr
+            << filename << ":" << validator.ErrorLine << ":" << validator.ErrorColumn
+            << " (offset " << validator.ErrorOffset << "): " << validator.Error
+            << std::endl;
+    }
+
+    if (bench) {
+        std::cout
+            << "Validating '" << filename << "' Completed in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+            << "ms."
+            << std::endl;
+    }
+    if (bench || stats) {
+        input.PrintStats(std::cout);
+    }
+
+    return valid ? 0 : 1;
+}
+
+int columnarFile(InputPipeline &input, const std::string &filename, bool noprint, bool bench, bool stats)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    std::string source;// The cursor needs the whole document in one piece
+    const char *chunk;
+    size_t length;
+    while (input.Next(chunk, length)) {
+        source.append(chunk, length);
+        input.Release();
+    }
+    if (input.Error() != nullptr) {
+        std::cerr << "Could not read '" << filename << "': " << input.Error() << std::endl;
+        return 1;
+    }
+
+    ColumnTable table;
+    JsonBindError error;
+    bool extracted = extractColumns(source.data(), source.length(), table, error);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if (!extracted) {
+        std::cerr << filename << ": " << error.Path << " (offset " << error.Offset << "): " << error.Message << std::endl;
+    }
+    else if (!noprint) {
+        printColumns(std::cout, table);
+    }
+
+    if (bench) {
+        std::cout
+            << "Extracting columns from '" << filename << "' Completed in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+            << "ms."
+            << std::endl;
+    }
+    if (bench || stats) {
+        input.PrintStats(std::cout);
+    }
+
+    return extracted ? 0 : 1;
+}
+
+
+BufferRing::BufferRing(size_t count, size_t size)
+    : BufferCount(count), BufferSize(size), full(count), empty(count)
+{
+    for (size_t i = 0; i < count; i++) {
+        buffers.push_back(new char[size]);
+        empty.Push(buffers.back());
+    }
+    Error = nullptr;
+    Waited = std::chrono::nanoseconds(0);
+    closed = false;
+    cancelled = false;
+}
+
+BufferRing::~BufferRing()
+{
+    for (auto iter = buffers.begin(); iter != buffers.end(); ++iter) {
+        delete[] *iter;
+    }
+}
+
+char *BufferRing::Acquire()
+{
+    char *buffer = nullptr;
+    waitUntil([&] { return empty.Front(buffer) || Cancelled(); });
+    if (Cancelled()) return nullptr;
+    empty.Pop();
+    return buffer;
+}
+
+char *BufferRing::TryAcquire()
+{
+    char *buffer;
+    if (Cancelled() || !empty.Front(buffer)) return nullptr;
+    empty.Pop();
+    return buffer;
+}
+
+void BufferRing::Publish(char *buffer, size_t length)
+{
+    full.Push(Chunk{ buffer, length });// Never full, there are only BufferCount buffers
+}
+
+void BufferRing::Close(const char *error)
+{
+    Error = error;
+    closed.store(true, std::memory_order_release);
+}
+
+bool BufferRing::Next(const char *&data, size_t &length)
+{
+    Chunk chunk;
+    if (!full.Front(chunk)) {
+        auto start = std::chrono::high_resolution_clock::now();
+        waitUntil([&] { return full.Front(chunk) || closed.load(std::memory_order_acquire); });
+        Waited += std::chrono::high_resolution_clock::now() - start;
+        if (!full.Front(chunk)) return false;// Closed, recheck for a last buffer published before
+    }
+    data = chunk.Data;
+    length = chunk.Length;
+    return true;
+}
+
+void BufferRing::Release()
+{
+    Chunk chunk;
+    full.Front(chunk);
+    full.Pop();
+    empty.Push(chunk.Data);
+}
+
+void BufferRing::Cancel()
+{
+    cancelled.store(true, std::memory_order_release);
+}
+
+Uring::Uring()
+{
+    ringFd = -1;
+    toSubmit = 0;
+    sqRing = MAP_FAILED;
+    cqRing = MAP_FAILED;
+    sqes = (io_uring_sqe *)MAP_FAILED;
+}
+
+Uring::~Uring()
+{
+    if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (ringFd >= 0) close(ringFd);
+}
+
+bool Uring::Setup(unsigned entries)
+{
+    io_uring_params params = {};
+    ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) return false;
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) return false;// Same kernel as IORING_OP_READ
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) return false;
+    cqRing = single
+        ? sqRing
+        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) return false;
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+
+    auto sq = (char *)sqRing;
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    auto cq = (char *)cqRing;
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void Uring::PrepareRead(int fd, char *buffer, unsigned length, uint64_t offset, uint64_t tag)
+{
+    auto tail = *sqTail;
+    auto index = tail & *sqMask;
+    auto sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+}
+
+int Uring::Submit(unsigned waitFor)
+{
+    while (true) {
+        int submitted = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (submitted >= 0) {
+            toSubmit -= submitted;
+            return submitted;
+        }
+        if (errno != EINTR) return -errno;
+    }
+}
+
+bool Uring::Complete(uint64_t &tag, int &result)
+{
+    auto head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+    auto cqe = &cqes[head & *cqMask];
+    tag = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+FileReader::FileReader(int fd, BufferRing &ring) : fd(fd), ring(ring)
+{
+    Backend = "pread";
+    ReadTime = std::chrono::nanoseconds(0);
+    reader = std::thread([this] { run(); });
+}
+
+FileReader::~FileReader()
+{
+    Stop();
+    close(fd);
+}
+
+void FileReader::Stop()
+{
+    ring.Cancel();
+    if (reader.joinable()) reader.join();
+}
+
+void FileReader::run()
+{
+    // Pipes, FIFOs and terminals have no offsets to read at: their reads
+    // would complete in any order, so they get plain read() one at a time
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        Backend = "read";
+        ring.Close(readPread(false));
+        return;
+    }
+    Uring uring;
+    if (ring.BufferCount > 1 && uring.Setup(ring.BufferCount)) {
+        Backend = "io_uring";
+        ring.Close(readUring(uring));
+    }
+    else {
+        ring.Close(readPread(true));
+    }
+}
+
+const char *FileReader::readUring(Uring &uring)
+{
+    // Reads are tagged with their sequence number modulo the buffer count:
+    // at most BufferCount are in flight, and they are published in order.
+    struct Slot
+    {
+        char *Buffer;
+        uint64_t Offset;
+        size_t Filled;
+        bool Done;
+    };
+    std::vector<Slot> slots(ring.BufferCount);
+    uint64_t submitted = 0;
+    uint64_t published = 0;
+    uint64_t offset = 0;
+    unsigned inFlight = 0;
+    bool eof = false;
+    const char *error = nullptr;
+
+    while (error == nullptr && !ring.Cancelled()) {
+        while (!eof && submitted - published < ring.BufferCount) {
+            auto buffer = submitted == published ? ring.Acquire() : ring.TryAcquire();
+            if (buffer == nullptr) break;
+            auto tag = submitted % ring.BufferCount;
+            slots[tag] = Slot{ buffer, offset, 0, false };
+            uring.PrepareRead(fd, buffer, ring.BufferSize, offset, tag);
+            inFlight++;
+            offset += ring.BufferSize;
+            submitted++;
+        }
+        if (submitted == published) break;// EOF, or cancelled while waiting for a buffer
+
+        auto start = std::chrono::high_resolution_clock::now();
+        auto result = uring.Submit(1);
+        ReadTime += std::chrono::high_resolution_clock::now() - start;
+        if (result < 0) {
+            error = std::strerror(-result);
+            break;
+        }
+
+        uint64_t tag;
+        int read;
+        while (uring.Complete(tag, read)) {
+            inFlight--;
+            auto &slot = slots[tag];
+            if (read < 0) {
+                error = std::strerror(-read);
+            }
+            else if (read == 0) {
+                slot.Done = true;
+                eof = true;
+            }
+            else if ((slot.Filled += read) == ring.BufferSize) {
+                slot.Done = true;
+            }
+            else {// Short read, ask for the rest
+                uring.PrepareRead(fd, slot.Buffer + slot.Filled, ring.BufferSize - slot.Filled, slot.Offset + slot.Filled, tag);
+                inFlight++;
+            }
+        }
+
+        for (; published < submitted && slots[published % ring.BufferCount].Done; published++) {
+            auto &slot = slots[published % ring.BufferCount];
+            if (slot.Filled > 0) ring.Publish(slot.Buffer, slot.Filled);
+        }
+    }
+
+    // The kernel may still write into buffers that are about to be freed
+    while (inFlight > 0 && uring.Submit(1) >= 0) {
+        uint64_t tag;
+        int read;
+        while (uring.Complete(tag, read)) inFlight--;
+    }
+    return error;
+}
+
+const char *FileReader::readPread(bool seekable)
+{
+    for (uint64_t offset = 0;;) {
+        auto buffer = ring.Acquire();
+        if (buffer == nullptr) return nullptr;
+        size_t filled = 0;
+        while (filled < ring.BufferSize) {
+            auto start = std::chrono::high_resolution_clock::now();
+            auto read = seekable
+                ? pread(fd, buffer + filled, ring.BufferSize - filled, offset + filled)
+                : ::read(fd, buffer + filled, ring.BufferSize - filled);
+            ReadTime += std::chrono::high_resolution_clock::now() - start;
+            if (read < 0 && errno == EINTR) continue;
+            if (read < 0) return std::strerror(errno);
+            if (read == 0) break;
+            filled += read;
+        }
+        if (filled > 0) ring.Publish(buffer, filled);
+        if (filled < ring.BufferSize) return nullptr;
+        offset += filled;
+    }
+}
+
+InputPipeline::InputPipeline(int fd, size_t bufferCount, size_t bufferSize)
+    : raw(bufferCount, bufferSize), source(&raw), reader(fd, raw)
+{
+    Format = "plain";
+    DecompressTime = std::chrono::nanoseconds(0);
+
+    // Peek at the first buffer, it stays queued for whoever consumes raw
+    const char *data;
+    size_t length;
+    if (!raw.Next(data, length)) return;
+    auto magic = (const unsigned char *)data;
+    if (length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        Format = "gzip";
+    }
+    else if (length >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        Format = "zstd";
+    }
+    else {
+        return;
+    }
+    decoded.reset(new BufferRing(bufferCount, bufferSize));
+    source = decoded.get();
+    decompressor = std::thread([this] { decompress(); });
+}
+
+InputPipeline::~InputPipeline()
+{
+    Stop();
+}
+
+void InputPipeline::Stop()
+{
+    if (decoded) {
+        decoded->Cancel();
+        if (decompressor.joinable()) decompressor.join();
+    }
+    reader.Stop();
+}
+
+void InputPipeline::PrintStats(std::ostream &out)
+{
+    out
+        << "  input " << Format << " via " << reader.Backend
+        << " (" << raw.BufferCount << " x " << raw.BufferSize / 1024 << "KiB buffers)"
+        << ", read " << std::chrono::duration_cast<std::chrono::milliseconds>(reader.ReadTime).count() << "ms"
+        << ", decompress " << std::chrono::duration_cast<std::chrono::milliseconds>(DecompressTime).count() << "ms"
+        << ", parser waited " << std::chrono::duration_cast<std::chrono::milliseconds>(source->Waited).count() << "ms"
+        << std::endl;
+}
+
+void InputPipeline::decompress()
+{
+    auto error = Format == std::string("gzip") ? inflateGzip() : decompressZstd();
+    decoded->Close(error != nullptr ? error : raw.Error);
+}
+
+const char *InputPipeline::inflateGzip()
+{
+    z_stream stream = {};
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) return "Could not initialise zlib";
+
+    const char *error = nullptr;
+    bool holding = false;// A raw buffer is being inflated
+    bool ended = false;// Between gzip members, a file may hold several
+    while (error == nullptr) {
+        auto buffer = decoded->Acquire();
+        if (buffer == nullptr) break;
+        stream.next_out = (Bytef *)buffer;
+        stream.avail_out = decoded->BufferSize;
+        while (stream.avail_out > 0) {
+            if (stream.avail_in == 0) {
+                const char *data;
+                size_t length;
+                if (holding) raw.Release();
+                holding = raw.Next(data, length);
+                if (!holding) break;
+                stream.next_in = (Bytef *)data;
+                stream.avail_in = length;
+            }
+            if (ended) {
+                inflateReset(&stream);
+                ended = false;
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            auto result = inflate(&stream, Z_NO_FLUSH);
+            DecompressTime += std::chrono::high_resolution_clock::now() - start;
+            if (result == Z_STREAM_END) {
+                ended = true;
+            }
+            else if (result != Z_OK && result != Z_BUF_ERROR) {
+                error = stream.msg != nullptr ? stream.msg : "Corrupt gzip stream";
+                break;
+            }
         }
+        auto produced = decoded->BufferSize - stream.avail_out;
+        if (produced > 0) decoded->Publish(buffer, produced);
+        if (stream.avail_out > 0) {
+            if (error == nullptr && !ended && raw.Error == nullptr) error = "Truncated gzip stream";
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    return error;
+}
 
-        return error("Expected :");
-    });
+const char *InputPipeline::decompressZstd()
+{
+#ifdef JSONPARSE_ZSTD
+    auto stream = ZSTD_createDStream();
+    ZSTD_inBuffer in = { nullptr, 0, 0 };
+    const char *error = nullptr;
+    bool holding = false;// A raw buffer is being decompressed
+    size_t remaining = 1;// Non-zero while a frame is incomplete
+    while (error == nullptr) {
+        auto buffer = decoded->Acquire();
+        if (buffer == nullptr) break;
+        ZSTD_outBuffer out = { buffer, decoded->BufferSize, 0 };
+        while (out.pos < out.size) {
+            if (in.pos == in.size) {
+                const char *data;
+                size_t length;
+                if (holding) raw.Release();
+                holding = raw.Next(data, length);
+                if (!holding) break;
+                in = { data, length, 0 };
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            remaining = ZSTD_decompressStream(stream, &out, &in);
+            DecompressTime += std::chrono::high_resolution_clock::now() - start;
+            if (ZSTD_isError(remaining)) {
+                error = ZSTD_getErrorName(remaining);
+                break;
+            }
+        }
+        if (out.pos > 0) decoded->Publish(buffer, out.pos);
+        if (out.pos < out.size) {
+            if (error == nullptr && remaining != 0 && raw.Error == nullptr) error = "Truncated zstd stream";
+            break;
+        }
+    }
+    ZSTD_freeDStream(stream);
+    return error;
+#else
+    return "Built without zstd support";
+#endif
 }
 
-ParseState *parseIntegerStart() {
-    if (AllowSuperfluousLeadingZeroes){
-        return parseInteger();
+static std::string unescapePointer(std::string segment)
+{
+    for (size_t i = 0; (i = segment.find('~', i)) != std::string::npos; i++) {
+        segment.replace(i, 2, segment.compare(i, 2, "~1") == 0 ? "/" : "~");
     }
-    return new ParseState([](char c) { 
-        if (c == '0')
-        {
-            token << c;
-            emit(TokenKind::Integer);
-            return parseOptionalDecimal();
+    return segment;
+}
+
+JToken *findPointer(JToken *root, const std::string &pointer)
+{
+    auto node = root;
+    size_t start = 0;
+    while (node != nullptr && start < pointer.length()) {
+        if (pointer[start] != '/') return nullptr;
+        auto end = std::min(pointer.find('/', start + 1), pointer.length());
+        auto name = unescapePointer(pointer.substr(start + 1, end - start - 1));
+        start = end;
+
+        if (node->Kind() == JTokenKind::ObjectToken) {
+            auto properties = dynamic_cast<JObject *>(node)->Properties;
+            auto found = std::find_if(properties->begin(), properties->end(), [&](JProperty *p) {
+                return p->NameString->Value->StringValue == name;
+            });
+            node = found != properties->end() ? (*found)->Value : nullptr;
         }
-        if (std::isdigit(c))
-        {
-            token << c;
-            return parseInteger();
+        else if (node->Kind() == JTokenKind::ArrayToken) {
+            boxElements(dynamic_cast<JArray *>(node));
+            auto values = dynamic_cast<JArray *>(node)->Values;
+            bool isIndex = !name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return std::isdigit((unsigned char)c); });
+            node = isIndex && std::stoull(name) < values->size() ? (*values)[std::stoull(name)]->Value : nullptr;
         }
-        return expectedInput("digit", c);
-    });
+        else {
+            node = nullptr;
+        }
+    }
+    return node;
 }
 
-ParseState *parseInteger() {
-    return new ParseState([](char c) { 
-        if (std::isdigit(c))
-        {
-            token << c;
-            return parseInteger();
+void markModified(JToken *node)
+{
+    for (; node != nullptr && !node->Modified; node = node->Parent) {
+        node->Modified = true;
+    }
+}
+
+void detach(JToken *node)
+{
+    node->Spanned = false;
+    node->Modified = true;
+    switch (node->Kind()) {
+    case JTokenKind::ObjectToken:
+    {
+        auto properties = dynamic_cast<JObject *>(node)->Properties;
+        for (auto iter = properties->begin(); iter != properties->end(); ++iter) {
+            detach(*iter);
         }
-        emit(TokenKind::Integer);
-        return unpeek(parseOptionalDecimal(), c);
-    });
+        break;
+    }
+    case JTokenKind::ArrayToken:
+    {
+        auto values = dynamic_cast<JArray *>(node)->Values;
+        for (auto iter = values->begin(); iter != values->end(); ++iter) {
+            detach(*iter);
+        }
+        break;
+    }
+    case JTokenKind::PropertyToken:
+        detach(dynamic_cast<JProperty *>(node)->NameString);
+        detach(dynamic_cast<JProperty *>(node)->Value);
+        break;
+    case JTokenKind::ArrayElementToken:
+        detach(dynamic_cast<JArrayElement *>(node)->Value);
+        break;
+    default:
+        break;
+    }
 }
 
-ParseState *parseOptionalDecimal() {
-    return new ParseState([](char c) { 
-        if (c == '.')
-        {
-            token << c;
-            emit(TokenKind::DecimalPoint);
-            return parseFractionalIntegerStart();
+void boxElements(JArray *array)
+{
+    if (array->Packed == nullptr) return;
+    delete array->Values;
+    array->Values = array->Packed->Box(0);
+    delete array->Packed;
+    array->Packed = nullptr;
+    for (auto iter = array->Values->begin(); iter != array->Values->end(); ++iter) {
+        (*iter)->Parent = array;
+        if (!array->Spanned) detach(*iter);
+    }
+}
+
+void replaceValue(JToken *value, JToken *replacement)
+{
+    auto parent = value->Parent;
+    if (parent->Kind() == JTokenKind::PropertyToken) {
+        dynamic_cast<JProperty *>(parent)->Value = replacement;
+    }
+    else {
+        dynamic_cast<JArrayElement *>(parent)->Value = replacement;
+    }
+    replacement->Parent = parent;
+    markModified(parent);
+    delete value;
+}
+
+JProperty *setProperty(JObject *object, const std::string &name, JToken *value)
+{
+    settleShifts(object);
+    auto properties = object->Properties;
+    for (auto iter = properties->begin(); iter != properties->end(); ++iter) {
+        if ((*iter)->NameString->Value->StringValue == name) {
+            replaceValue((*iter)->Value, value);
+            return *iter;
         }
-        tokens.push(nullptr);// .
-        tokens.push(nullptr);// XXX
-        return unpeek(parseOptionalExp(), c);
+    }
+
+    auto property = new JProperty(
+        new JString(
+            new Token(TokenKind::DoubleQuote, "\"", 0),
+            new Token(TokenKind::String, name, 0),
+            new Token(TokenKind::DoubleQuote, "\"", 0)),
+        new Token(TokenKind::Colon, ":", 0),
+        value,
+        nullptr);
+    property->NameString->Parent = property;
+    value->Parent = property;
+    detach(property);
+    if (!properties->empty()) {
+        auto last = properties->back();
+        if (last->TrailingComma != nullptr) {// Keep using trailing commas if the object did
+            property->TrailingComma = new Token(TokenKind::Comma, ",", 0);
+        }
+        else {
+            last->TrailingComma = new Token(TokenKind::Comma, ",", 0);
+            markModified(last);
+        }
+    }
+    properties->push_back(property);
+    property->Parent = object;
+    markModified(object);
+    return property;
+}
+
+bool removeProperty(JObject *object, const std::string &name)
+{
+    settleShifts(object);
+    auto properties = object->Properties;
+    auto found = std::find_if(properties->begin(), properties->end(), [&](JProperty *p) {
+        return p->NameString->Value->StringValue == name;
     });
+    if (found == properties->end()) return false;
+
+    auto removed = *found;
+    bool wasLast = found + 1 == properties->end();
+    properties->erase(found);
+    if (wasLast && removed->TrailingComma == nullptr && !properties->empty() && properties->back()->TrailingComma != nullptr) {
+        delete properties->back()->TrailingComma;
+        properties->back()->TrailingComma = nullptr;
+        markModified(properties->back());
+    }
+    delete removed;
+    markModified(object);
+    return true;
 }
 
-ParseState *parseFractionalIntegerStart() {
-    return new ParseState([](char c) { 
-        if (std::isdigit(c))
-        {
-            token << c;
-            return parseFractionalInteger();
+void appendElement(JArray *array, JToken *value)
+{
+    boxElements(array);
+    settleShifts(array);
+    auto values = array->Values;
+    auto element = new JArrayElement(value, nullptr);
+    value->Parent = element;
+    detach(element);
+    if (!values->empty()) {
+        auto last = values->back();
+        if (last->TrailingComma != nullptr) {// Keep using trailing commas if the array did
+            element->TrailingComma = new Token(TokenKind::Comma, ",", 0);
         }
-        return expectedInput("digit", c);
-    });
+        else {
+            last->TrailingComma = new Token(TokenKind::Comma, ",", 0);
+            markModified(last);
+        }
+    }
+    values->push_back(element);
+    element->Parent = array;
+    markModified(array);
 }
 
-ParseState *parseFractionalInteger() {
-    return new ParseState([](char c) { 
-        if (std::isdigit(c))
-        {
-            token << c;
-            return parseFractionalInteger();
+bool removeElement(JArray *array, size_t index)
+{
+    boxElements(array);
+    settleShifts(array);
+    auto values = array->Values;
+    if (index >= values->size()) return false;
+
+    auto removed = (*values)[index];
+    bool wasLast = index + 1 == values->size();
+    values->erase(values->begin() + index);
+    if (wasLast && removed->TrailingComma == nullptr && !values->empty() && values->back()->TrailingComma != nullptr) {
+        delete values->back()->TrailingComma;
+        values->back()->TrailingComma = nullptr;
+        markModified(values->back());
+    }
+    delete removed;
+    markModified(array);
+    return true;
+}
+
+void writeDocument(std::ostream &out, JToken *root, const char *source, size_t length)
+{
+    if (!root->Spanned) {
+        root->Write(out, source);
+        out << std::endl;
+        return;
+    }
+    writeSource(out, source, 0, root->Begin);
+    root->Write(out, source);
+    writeSource(out, source, root->End, length);
+    out.flush();
+}
+
+// -set /pointer=json: replaces the value at pointer, adds the property if the
+// parent is an object, or appends when the last segment is "-" on an array.
+bool applySet(JToken *&root, const std::string &assignment)
+{
+    auto equals = assignment.find('=');
+    if (equals == std::string::npos) {
+        std::cerr << "Expected -set /pointer=json, got '" << assignment << "'" << std::endl;
+        return false;
+    }
+    auto pointer = assignment.substr(0, equals);
+    auto text = assignment.substr(equals + 1);
+    auto value = parseDocument(text.data(), text.length());
+    if (value == nullptr || parseFailed) {
+        std::cerr << "Invalid JSON for -set " << pointer << ": '" << text << "'" << std::endl;
+        delete value;
+        return false;
+    }
+    detach(value);
+
+    if (pointer.empty()) {
+        delete root;
+        root = value;
+        return true;
+    }
+    auto existing = findPointer(root, pointer);
+    if (existing != nullptr) {
+        replaceValue(existing, value);
+        return true;
+    }
+    auto slash = pointer.rfind('/');
+    auto parent = slash == std::string::npos ? nullptr : findPointer(root, pointer.substr(0, slash));
+    auto name = unescapePointer(pointer.substr(slash + 1));
+    if (parent != nullptr && parent->Kind() == JTokenKind::ObjectToken) {
+        setProperty(dynamic_cast<JObject *>(parent), name, value);
+        return true;
+    }
+    if (parent != nullptr && parent->Kind() == JTokenKind::ArrayToken && name == "-") {
+        appendElement(dynamic_cast<JArray *>(parent), value);
+        return true;
+    }
+    std::cerr << "No such path for -set: '" << pointer << "'" << std::endl;
+    delete value;
+    return false;
+}
+
+// A piece of the Print output, in document order: Node printed at Indent,
+// or its properties, elements or packed numbers [From, To) when Children is
+// set, or fixed Text (a container's header line) when Node is nullptr
+struct PrintSlice
+{
+    JToken *Node;
+    bool Children;
+    size_t From;
+    size_t To;
+    std::string Indent;
+    std::string Text;// Filled in by the print threads
+};
+
+// Bytes the node took in the source, a good guess at how much it prints
+static size_t printWeight(JToken *node)
+{
+    return node->Spanned ? node->End - node->Begin : 1;
+}
+
+// Batches the children of node into slices of about grain, descending into
+// the ones that are heavier than that on their own
+static void slicePrint(JToken *node, const std::string &indent, size_t grain, std::vector<PrintSlice> &slices)
+{
+    auto inner = indent + ONE_INDENT;
+    size_t from = 0;
+    size_t weight = 0;
+    auto flush = [&](size_t to) {
+        if (to > from) slices.push_back(PrintSlice{node, true, from, to, inner, ""});
+        from = to;
+        weight = 0;
+    };
+
+    if (node->Kind() == JTokenKind::ObjectToken) {
+        slices.push_back(PrintSlice{nullptr, false, 0, 0, "", indent + "Object:\n"});
+        auto properties = dynamic_cast<JObject *>(node)->Properties;
+        for (size_t i = 0; i < properties->size(); i++) {
+            auto property = (*properties)[i];
+            auto value = property->Value;
+            if (printWeight(property) > grain && (value->Kind() == JTokenKind::ObjectToken || value->Kind() == JTokenKind::ArrayToken)) {
+                flush(i);
+                slices.push_back(PrintSlice{nullptr, false, 0, 0, "", inner + "Property '" + property->NameString->Value->StringValue + "':\n"});
+                slicePrint(value, inner + ONE_INDENT, grain, slices);
+                from = i + 1;
+                continue;
+            }
+            weight += printWeight(property);
+            if (weight >= grain) flush(i + 1);
         }
-        emit(TokenKind::Integer);
-        return unpeek(parseOptionalExp(), c);
-    });
+        flush(properties->size());
+        return;
+    }
+
+    slices.push_back(PrintSlice{nullptr, false, 0, 0, "", indent + "Array:\n"});
+    auto array = dynamic_cast<JArray *>(node);
+    if (array->Packed != nullptr) {
+        auto size = array->Packed->Size();
+        auto step = std::max((size_t)1, grain * size / std::max(printWeight(array), (size_t)1));
+        for (size_t i = 0; i < size; i += step) slices.push_back(PrintSlice{node, true, i, std::min(i + step, size), inner, ""});
+        return;
+    }
+    auto values = array->Values;
+    for (size_t i = 0; i < values->size(); i++) {
+        auto value = (*values)[i]->Value;
+        if (printWeight(value) > grain && (value->Kind() == JTokenKind::ObjectToken || value->Kind() == JTokenKind::ArrayToken)) {
+            flush(i);
+            slicePrint(value, inner, grain, slices);
+            from = i + 1;
+            continue;
+        }
+        weight += printWeight((*values)[i]);
+        if (weight >= grain) flush(i + 1);
+    }
+    flush(values->size());
 }
 
-ParseState *parseOptionalExp() {
-    return new ParseState([](char c) { 
-        if (c == 'e' || c == 'E')
-        {
-            token << c;
-            emit(TokenKind::Exp);
-            return parseOptionalExpSign();
+static void printSlice(PrintSlice &slice)
+{
+    std::ostringstream out;
+    if (!slice.Children) {
+        slice.Node->Print(out, slice.Indent);
+    }
+    else if (slice.Node->Kind() == JTokenKind::ObjectToken) {
+        auto properties = dynamic_cast<JObject *>(slice.Node)->Properties;
+        for (auto i = slice.From; i < slice.To; i++) (*properties)[i]->Print(out, slice.Indent);
+    }
+    else if (dynamic_cast<JArray *>(slice.Node)->Packed != nullptr) {
+        auto packed = dynamic_cast<JArray *>(slice.Node)->Packed;
+        for (auto i = slice.From; i < slice.To; i++) out << slice.Indent << packed->Spelling(i) << '\n';
+    }
+    else {
+        auto values = dynamic_cast<JArray *>(slice.Node)->Values;
+        for (auto i = slice.From; i < slice.To; i++) (*values)[i]->Print(out, slice.Indent);
+    }
+    slice.Text = out.str();
+}
+
+// writev until everything is out, picking up after short writes
+static bool writeAll(int fd, iovec *iov, int count)
+{
+    while (count > 0) {
+        auto written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
         }
-        tokens.push(nullptr);// e
-        tokens.push(nullptr);// +/-
-        tokens.push(nullptr);// XXX
-        return unpeek(pushNode(), c);
-    });
+        for (; count > 0 && (size_t)written >= iov->iov_len; iov++, count--) written -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
 }
 
-ParseState *parseOptionalExpSign() {
-    return new ParseState([](char c) { 
-        if (c == '-' || c == '+')
-        {
-            token << c;
-            emit(TokenKind::Sign);
-            return parseExpIntegerStart();
+// Buffered output straight to a file descriptor, for the serial path
+class FdBuffer : public std::streambuf
+{
+public:
+    FdBuffer(int fd) : fd(fd), buffer(PRINT_SLICE_KIB * 1024)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+    ~FdBuffer() { sync(); }
+
+    bool Failed = false;
+
+protected:
+    int overflow(int c) override
+    {
+        if (sync() != 0) return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
         }
-        tokens.push(nullptr);// +/-
-        return unpeek(parseExpIntegerStart(), c);
-    });
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        iovec pending{pbase(), (size_t)(pptr() - pbase())};
+        if (pending.iov_len > 0 && !writeAll(fd, &pending, 1)) {
+            Failed = true;
+            return -1;
+        }
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return 0;
+    }
+
+private:
+    int fd;
+    std::vector<char> buffer;
+};
+
+bool printDocument(JToken *root, unsigned threads, int fd, size_t minSlice)
+{
+    std::cout.flush();// fd is usually stdout
+    auto grain = std::max(printWeight(root) / (threads * 8), minSlice);
+    if (threads <= 1 || printWeight(root) <= grain || (root->Kind() != JTokenKind::ObjectToken && root->Kind() != JTokenKind::ArrayToken)) {
+        FdBuffer buffer(fd);
+        std::ostream out(&buffer);
+        root->Print(out, "");
+        out.flush();
+        if (buffer.Failed) std::cerr << "Could not write the output: " << std::strerror(errno) << std::endl;
+        return !buffer.Failed;
+    }
+
+    std::vector<PrintSlice> slices;
+    slicePrint(root, "", grain, slices);
+    std::unique_ptr<std::atomic<bool>[]> done(new std::atomic<bool>[slices.size()]);
+    for (size_t i = 0; i < slices.size(); i++) done[i] = slices[i].Node == nullptr;
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            for (size_t i; (i = next.fetch_add(1)) < slices.size();) {
+                if (slices[i].Node == nullptr) continue;
+                printSlice(slices[i]);
+                done[i].store(true, std::memory_order_release);
+            }
+        });
+    }
+
+    // Writes whatever is done in order, while the threads work on the rest
+    bool written = true;
+    std::vector<iovec> batch;
+    for (size_t first = 0; first < slices.size();) {
+        waitUntil([&]() { return done[first].load(std::memory_order_acquire); });
+        batch.clear();
+        auto end = first;
+        for (; end < slices.size() && batch.size() < IOV_MAX && done[end].load(std::memory_order_acquire); end++) {
+            batch.push_back(iovec{(void *)slices[end].Text.data(), slices[end].Text.length()});
+        }
+        if (!writeAll(fd, batch.data(), (int)batch.size())) {
+            std::cerr << "Could not write the output: " << std::strerror(errno) << std::endl;
+            written = false;
+            break;
+        }
+        for (; first < end; first++) std::string().swap(slices[first].Text);
+    }
+
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter) iter->join();
+    return written;
+}
+
+void GapBuffer::moveGap(size_t offset)
+{
+    if (offset < gapBegin) {
+        std::memmove(&text[offset + gapLength], &text[offset], gapBegin - offset);
+    }
+    else {
+        std::memmove(&text[gapBegin], &text[gapBegin + gapLength], offset - gapBegin);
+    }
+    gapBegin = offset;
+}
+
+void GapBuffer::Replace(size_t offset, size_t removed, const char *inserted, size_t length)
+{
+    moveGap(offset);
+    gapLength += removed;
+    if (gapLength < length) {
+        // Doubles, so that growing the gap in the middle stays amortized
+        auto grow = std::max(length - gapLength, text.size());
+        text.insert(gapBegin, grow, '\0');
+        gapLength += grow;
+    }
+    std::memcpy(&text[gapBegin], inserted, length);
+    gapBegin += length;
+    gapLength -= length;
+}
+
+const char *GapBuffer::Data()
+{
+    moveGap(Length());
+    return text.data();
+}
+
+// Index of the last child starting at or before offset (relative to the
+// container's Begin), or the number of children when none does
+template <typename T>
+static size_t childAt(std::vector<T *> &children, SiblingShifts &shifts, size_t offset)
+{
+    size_t low = 0;
+    size_t high = children.size();
+    while (low < high) {
+        auto middle = low + (high - low) / 2;
+        if (offset < children[middle]->Begin + shifts.At(middle)) high = middle;
+        else low = middle + 1;
+    }
+    return low == 0 ? children.size() : low - 1;
+}
+
+JToken *reparse(JToken *root, GapBuffer &source, const TextEdit &edit, size_t *reparsed)
+{
+    source.Replace(edit.Offset, edit.Removed, edit.Inserted.data(), edit.Inserted.length());
+    auto delta = (ptrdiff_t)edit.Inserted.length() - (ptrdiff_t)edit.Removed;
+    auto editEnd = edit.Offset + edit.Removed;
+
+    // Values strictly containing the edit, outermost first, with the
+    // absolute offset their span is relative to and the index of the child
+    // that holds the next one
+    struct Candidate
+    {
+        JToken *Value;
+        size_t Origin;
+        size_t Child;
+    };
+    std::vector<Candidate> candidates;
+    auto node = root != nullptr && root->Spanned && !root->Modified ? root : nullptr;
+    size_t origin = 0;
+    while (node != nullptr && origin + node->Begin < edit.Offset && editEnd < origin + node->End) {
+        candidates.push_back(Candidate{node, origin, 0});
+        origin += node->Begin;
+        JToken *child = nullptr;
+        ptrdiff_t shift = 0;
+        auto &index = candidates.back().Child;
+        if (node->Kind() == JTokenKind::ObjectToken) {
+            auto object = dynamic_cast<JObject *>(node);
+            index = childAt(*object->Properties, object->Shifts, edit.Offset - origin);
+            if (index < object->Properties->size()) {
+                shift = object->Shifts.At(index);
+                if (editEnd - origin <= (*object->Properties)[index]->End + shift) child = (*object->Properties)[index];
+            }
+        }
+        else if (node->Kind() == JTokenKind::ArrayToken) {
+            auto array = dynamic_cast<JArray *>(node);
+            index = childAt(*array->Values, array->Shifts, edit.Offset - origin);
+            if (index < array->Values->size()) {
+                shift = array->Shifts.At(index);
+                if (editEnd - origin <= (*array->Values)[index]->End + shift) child = (*array->Values)[index];
+            }
+        }
+        node = nullptr;
+        if (child != nullptr) {
+            origin += child->Begin + shift;
+            node = child->Kind() == JTokenKind::PropertyToken
+                ? dynamic_cast<JProperty *>(child)->Value
+                : dynamic_cast<JArrayElement *>(child)->Value;
+        }
+    }
+
+    reportErrors = false;
+    JToken *replacement = nullptr;
+    JToken *replaced = nullptr;
+    auto level = candidates.size();
+    while (level > 0 && replacement == nullptr) {
+        level--;
+        replaced = candidates[level].Value;
+        origin = candidates[level].Origin;
+        auto begin = origin + replaced->Begin;
+        auto end = origin + replaced->End + delta;
+        auto state = beginParse(begin);
+        source.Read(begin, end, [&](const char *data, size_t length) { state = feed(state, data, length); });
+        replacement = endParse(state);
+        if (parseFailed) {
+            delete replacement;
+            replacement = nullptr;
+        }
+        *reparsed = end - begin;
+    }
+    reportErrors = true;
+
+    if (replacement == nullptr) {
+        delete root;
+        *reparsed = source.Length();
+        return parseDocument(source.Data(), source.Length());
+    }
+
+    shiftSpan(replacement, -(ptrdiff_t)origin);
+    auto parent = replaced->Parent;
+    delete replaced;
+    if (parent == nullptr) return replacement;
+    replacement->Parent = parent;
+    if (parent->Kind() == JTokenKind::PropertyToken) {
+        dynamic_cast<JProperty *>(parent)->Value = replacement;
+    }
+    else {
+        dynamic_cast<JArrayElement *>(parent)->Value = replacement;
+    }
+
+    // Everything after the edit moves by delta: the ends of the enclosing
+    // nodes, and at each level the later siblings in a single move, which
+    // carry their children along since those are relative to them
+    while (level > 0) {
+        level--;
+        auto container = candidates[level].Value;
+        auto index = candidates[level].Child;
+        if (container->Kind() == JTokenKind::ObjectToken) {
+            auto object = dynamic_cast<JObject *>(container);
+            auto property = (*object->Properties)[index];
+            property->ValueEnd += delta;
+            property->End += delta;
+            object->Shifts.Move(object->Properties->size(), index + 1, delta);
+            object->ContentEnd += delta;
+        }
+        else {
+            auto array = dynamic_cast<JArray *>(container);
+            auto element = (*array->Values)[index];
+            element->ValueEnd += delta;
+            element->End += delta;
+            array->Shifts.Move(array->Values->size(), index + 1, delta);
+            array->ContentEnd += delta;
+        }
+        container->End += delta;
+    }
+    return root;
+}
+
+bool parseEdit(const std::string &argument, TextEdit &edit)
+{
+    auto first = argument.find(':');
+    auto second = first == std::string::npos ? first : argument.find(':', first + 1);
+    if (second == std::string::npos) return false;
+    try {
+        edit.Offset = std::stoull(argument.substr(0, first));
+        edit.Removed = std::stoull(argument.substr(first + 1, second - first - 1));
+    }
+    catch (std::exception &) {
+        return false;
+    }
+    edit.Inserted = argument.substr(second + 1);
+    return true;
 }
 
-ParseState *parseExpIntegerStart() {
-    return new ParseState([](char c) { 
-        if (std::isdigit(c))
-        {
-            token << c;
-            return parseExpInteger();
-        }
-        return expectedInput("digit", c);
-    });
+template <typename F>
+static std::chrono::nanoseconds timeMode(F run, bool repeat)
+{
+    auto best = std::chrono::nanoseconds::max();
+    std::chrono::nanoseconds total(0);
+    int runs = 0;
+    do {
+        auto start = std::chrono::high_resolution_clock::now();
+        run();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start);
+        best = std::min(best, elapsed);
+        total += elapsed;
+        runs++;
+    } while (repeat && (runs < TIMING_MIN_RUNS || total < std::chrono::milliseconds(20)));
+    return best;
 }
 
-ParseState *parseExpInteger() {
-    return new ParseState([](char c) { 
-        if (std::isdigit(c))
-        {
-            token << c;
-            return parseExpInteger();
-        }
-        emit(TokenKind::Integer);
-        return unpeek(pushNode(), c);
-    });
+// The fixed work mode timings are divided by, so that a baseline holds
+// ratios rather than the speed of the machine it was recorded on. FNV-1a,
+// one multiply per byte in a chain the compiler can't vectorize.
+static volatile uint32_t calibrationSink;
+
+static void calibrate(const char *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    calibrationSink = hash;
 }
 
-ParseState *pushNode(){
-    auto kind = nodeKinds.top();
-    nodeKinds.pop();
-    bool hadTrailingComma = false;
-    switch (kind)
-    {
-    case JTokenKind::LiteralToken:
+static std::string printed(JToken *root)
+{
+    std::ostringstream out;
+    root->Print(out, "");
+    return out.str();
+}
+
+// Bound in checkModes, so that the binding templates are compiled and fuzzed.
+// The keys are from tests.json.
+struct DifferentialRecord
+{
+    std::vector<int64_t> integers;
+    bool flag = false;
+    std::optional<int64_t> optional;
+    double number = 0;
+    std::string text;
+    std::vector<DifferentialRecord> records;
+
+    bool operator==(const DifferentialRecord &other) const
     {
-        auto value = tokens.top(); tokens.pop();
-        nodes.push(new JLiteral(value));
-        break;
+        return integers == other.integers && flag == other.flag && optional == other.optional
+            && number == other.number && text == other.text && records == other.records;
     }
-    case JTokenKind::NumberToken:
-    {
-        auto expPart = tokens.top(); tokens.pop();
-        auto expSign = tokens.top(); tokens.pop();
-        auto exp = tokens.top(); tokens.pop();
-        auto fractionalPart = tokens.top(); tokens.pop();
-        auto decimal = tokens.top(); tokens.pop();
-        auto wholePart = tokens.top(); tokens.pop();
-        auto leadingMinus =   tokens.top(); tokens.pop();
+};
 
-        nodes.push(new JNumber(leadingMinus, wholePart, decimal, fractionalPart, exp, expSign, expPart));
-        break;
-    }
-    case JTokenKind::ObjectToken:
-    {
-        auto end = tokens.top(); tokens.pop();
-        auto props = new std::vector<JProperty *>();
-        while (!nodes.empty())
-        {
-            if (nodes.top()->Kind() == JTokenKind::PropertyToken){
-                props->push_back(dynamic_cast<JProperty *>(nodes.top()));
-                nodes.pop();
+JSON_BINDING(DifferentialRecord,
+    JSON_FIELD_AS(DifferentialRecord, integers, "am"),
+    JSON_FIELD_AS(DifferentialRecord, flag, "l1"),
+    JSON_FIELD_AS(DifferentialRecord, optional, "l3"),
+    JSON_FIELD_AS(DifferentialRecord, number, "SDES"),
+    JSON_FIELD_AS(DifferentialRecord, text, "string"),
+    JSON_FIELD(DifferentialRecord, records));
+
+// A number as bindValue converts it, false where it has to reject it
+template <typename T>
+static bool expectNumber(const std::string &text, T &out)
+{
+    if (std::is_integral<T>::value && text.find_first_of(".eE") != std::string::npos) return false;
+    auto result = std::from_chars(text.data(), text.data() + text.length(), out);
+    return result.ec == std::errc() && result.ptr == text.data() + text.length();
+}
+
+template <typename T>
+static bool expectNumber(JToken *value, T &out)
+{
+    return value->Kind() == JTokenKind::NumberToken && expectNumber(dynamic_cast<JNumber *>(value)->Text(), out);
+}
+
+// What bindJson has to make of a DOM value, read off the tree instead of the
+// text. False where it has to reject the value.
+static bool expectRecord(JToken *value, DifferentialRecord &out)
+{
+    if (value->Kind() != JTokenKind::ObjectToken) return false;
+    auto properties = dynamic_cast<JObject *>(value)->Properties;
+    for (auto iter = properties->begin(); iter != properties->end(); ++iter) {
+        auto &name = (*iter)->NameString->Value->StringValue;
+        auto field = (*iter)->Value;
+        auto literal = field->Kind() == JTokenKind::LiteralToken ? dynamic_cast<JLiteral *>(field)->Value->StringValue : "";
+        if (name == "am" || name == "records") {
+            if (field->Kind() != JTokenKind::ArrayToken) return false;
+            auto array = dynamic_cast<JArray *>(field);
+            if (name == "am") out.integers.clear();
+            else out.records.clear();
+            for (size_t i = 0; array->Packed != nullptr && i < array->Packed->Size(); i++) {
+                if (name == "records") return false;
+                out.integers.emplace_back();
+                if (!expectNumber(array->Packed->Spelling(i), out.integers.back())) return false;
             }
-            else {
-                break;
+            for (auto element = array->Values->begin(); element != array->Values->end(); ++element) {
+                if (name == "am") {
+                    out.integers.emplace_back();
+                    if (!expectNumber((*element)->Value, out.integers.back())) return false;
+                }
+                else {
+                    out.records.emplace_back();
+                    if (!expectRecord((*element)->Value, out.records.back())) return false;
+                }
             }
         }
-        std::reverse(props->begin(), props->end());
-        auto begin = tokens.top(); tokens.pop();
-        nodes.push(new JObject(begin, props, end));
-        break;
-    }
-    case JTokenKind::ArrayToken:
-    {
-        auto end = tokens.top(); tokens.pop();
-        auto elems = new std::vector<JArrayElement *>();
-        while (!nodes.empty())
-        {
-            if (nodes.top()->Kind() == JTokenKind::ArrayElementToken){
-                elems->push_back(dynamic_cast<JArrayElement *>(nodes.top()));
-                nodes.pop();
+        else if (name == "l1") {
+            if (literal != "true" && literal != "false") return false;
+            out.flag = literal == "true";
+        }
+        else if (name == "l3") {
+            if (literal == "null") {
+                out.optional.reset();
             }
             else {
-                break;
+                int64_t integer;
+                if (!expectNumber(field, integer)) return false;
+                out.optional = integer;
             }
         }
-        std::reverse(elems->begin(), elems->end());
-        auto begin = tokens.top(); tokens.pop();
-        nodes.push(new JArray(begin, elems, end));
-        break;
+        else if (name == "SDES") {
+            if (!expectNumber(field, out.number)) return false;
+        }
+        else if (name == "string") {
+            if (field->Kind() != JTokenKind::StringToken) return false;
+            out.text = dynamic_cast<JString *>(field)->Value->StringValue;
+        }
     }
-    case JTokenKind::ArrayElementToken:
-    {
-        auto trailing = tokens.top(); tokens.pop();
-        auto value = nodes.top(); nodes.pop();
-        nodes.push(new JArrayElement(value, trailing));
-        hadTrailingComma = trailing != nullptr;
-        break;
+    return true;
+}
+
+bool checkModes(const char *data, size_t length, bool repeat, DifferentialResult &result)
+{
+    result.Disagreement.clear();
+    result.Timings.clear();
+    // Calibrated before and after the modes, keeping the best
+    result.Calibration = timeMode([&]() { calibrate(data, length); }, repeat);
+    auto disagree = [&](const std::string &message) {
+        if (result.Disagreement.empty()) result.Disagreement = message;
+    };
+    auto verdict = [](const char *mode, bool accepted) {
+        return std::string(mode) + (accepted ? " accepts" : " rejects");
+    };
+
+    bool validated = false;
+    const char *validateError = nullptr;
+    result.Timings.push_back(ModeTiming{"validate", timeMode([&]() {
+        Validator validator;
+        validated = validator.Feed(data, length) && validator.Finish();
+        validateError = validator.Error;
+    }, repeat)});
+    bool tooDeep = !validated && std::strcmp(validateError, "Maximum nesting depth exceeded") == 0;
+
+    bool chunkValidated = false;
+    result.Timings.push_back(ModeTiming{"validate-chunked", timeMode([&]() {
+        Validator validator;
+        chunkValidated = true;
+        for (size_t i = 0; i < length && chunkValidated; i++) chunkValidated = validator.Feed(data + i, 1);
+        chunkValidated = chunkValidated && validator.Finish();
+    }, repeat)});
+    if (chunkValidated != validated) disagree(verdict("validate", validated) + ", " + verdict("validate-chunked", chunkValidated));
+
+    bool skipped = false;
+    result.Timings.push_back(ModeTiming{"cursor", timeMode([&]() {
+        JsonCursor cursor(data, length);
+        skipWhitespace(cursor);
+        skipped = skipValue(cursor);
+        if (skipped) {
+            skipWhitespace(cursor);
+            skipped = cursor.Pos == cursor.End;
+        }
+    }, repeat)});
+    if (skipped != validated) disagree(verdict("validate", validated) + ", " + verdict("cursor", skipped));
+
+    reportErrors = false;
+    JToken *root = nullptr;
+    result.Timings.push_back(ModeTiming{"dom", timeMode([&]() {
+        delete root;
+        root = parseDocument(data, length);
+    }, repeat)});
+    bool accepted = root != nullptr && !parseFailed;
+
+    JToken *chunked = nullptr;
+    result.Timings.push_back(ModeTiming{"dom-chunked", timeMode([&]() {
+        delete chunked;
+        auto state = beginParse();
+        for (size_t i = 0; i < length; i++) state = feed(state, data + i, 1);
+        chunked = endParse(state);
+    }, repeat)});
+    bool chunkAccepted = chunked != nullptr && !parseFailed;
+    reportErrors = true;
+
+    result.Accepted = accepted;
+    if (!accepted) {
+        delete root;
+        root = nullptr;
     }
-    case JTokenKind::StringToken:
-    case JTokenKind::PropertyNameToken:
-    {
-        auto end = tokens.top(); tokens.pop();
-        auto value = tokens.top(); tokens.pop();
-        auto start = tokens.top(); tokens.pop();
-        nodes.push(new JString(start, value, end));
-        break;
+    if (accepted != validated && !tooDeep) disagree(verdict("validate", validated) + ", " + verdict("dom", accepted));
+    if (chunkAccepted != accepted) disagree(verdict("dom", accepted) + ", " + verdict("dom-chunked", chunkAccepted));
+
+    std::string reference;
+    if (accepted) {
+        result.Timings.push_back(ModeTiming{"print", timeMode([&]() { reference = printed(root); }, repeat)});
+        if (chunkAccepted && printed(chunked) != reference) disagree("dom-chunked prints differently from dom");
+
+        std::string written;
+        result.Timings.push_back(ModeTiming{"roundtrip", timeMode([&]() {
+            std::ostringstream out;
+            writeDocument(out, root, data, length);
+            written = out.str();
+        }, repeat)});
+        if (written != std::string(data, length)) disagree("roundtrip output differs from the input");
+
+        // The threaded printer, into a memory file, with slices small
+        // enough that even short inputs are split across the threads
+        std::string parallel;
+        int fd = memfd_create("print-parallel", 0);
+        if (fd < 0) {
+            disagree(std::string("print-parallel could not create its output file: ") + std::strerror(errno));
+        }
+        else {
+            bool printedOk = false;
+            result.Timings.push_back(ModeTiming{"print-parallel", timeMode([&]() {
+                ftruncate(fd, 0);
+                lseek(fd, 0, SEEK_SET);
+                printedOk = printDocument(root, 4, fd, std::max(length / 64, (size_t)1));
+            }, repeat)});
+            parallel.resize(lseek(fd, 0, SEEK_END));
+            if (!printedOk || pread(fd, &parallel[0], parallel.length(), 0) != (ssize_t)parallel.length()) {
+                disagree("print-parallel could not write its output");
+            }
+            else if (parallel != reference) {
+                disagree("print-parallel prints differently from print");
+            }
+            close(fd);
+        }
     }
-    case JTokenKind::PropertyToken:
-    {
-        auto trailingComma = tokens.top(); tokens.pop();
-        auto value = nodes.top(); nodes.pop();
-        auto colon = tokens.top(); tokens.pop();
-        auto name = dynamic_cast<JString*>(nodes.top()); nodes.pop();
-        nodes.push(new JProperty(name, colon, value, trailingComma));
-        hadTrailingComma = trailingComma != nullptr;
-        break;
+    delete chunked;
+
+    // Only arrays of objects have columns, anything else has to be rejected
+    auto array = root != nullptr && root->Kind() == JTokenKind::ArrayToken ? dynamic_cast<JArray *>(root) : nullptr;
+    bool records = array != nullptr && array->Packed == nullptr && !tooDeep
+        && std::all_of(array->Values->begin(), array->Values->end(), [](JArrayElement *e) { return e->Value->Kind() == JTokenKind::ObjectToken; });
+    ColumnTable table;
+    JsonBindError error;
+    bool extracted = false;
+    result.Timings.push_back(ModeTiming{"columnar", timeMode([&]() {
+        extracted = extractColumns(data, length, table, error);
+    }, repeat)});
+    if (extracted != records) {
+        disagree(std::string("columnar ") + (extracted ? "accepts" : "rejects (" + error.Path + ": " + error.Message + ")")
+            + (records ? " an array of objects" : " what isn't a valid array of objects"));
     }
-    default:
-        std::cerr << "Could not push node " << kind << std::endl;
-        return ignoreInput();
+    else if (extracted && table.Rows != array->Values->size()) {
+        disagree("columnar has " + std::to_string(table.Rows) + " rows for " + std::to_string(array->Values->size()) + " objects");
     }
 
-    if (nodeKinds.empty()){
-        return ignoreWhitespace(eof());
+    DifferentialRecord record;
+    bool bound = false;
+    result.Timings.push_back(ModeTiming{"bind", timeMode([&]() {
+        record = DifferentialRecord();
+        bound = bindJson(data, length, record, error);
+    }, repeat)});
+    DifferentialRecord expected;
+    bool bindable = root != nullptr && expectRecord(root, expected);
+    if (!tooDeep && bound != bindable) {
+        disagree(std::string("bind ") + (bound ? "accepts" : "rejects (" + error.Path + ": " + error.Message + ")")
+            + (bindable ? " a record the dom holds" : " what the dom doesn't hold as a record"));
     }
-
-    switch (nodeKinds.top()){
-    case JTokenKind::ObjectToken:
-        return ignoreWhitespace(hadTrailingComma 
-            ? (AllowTrailingCommas ? parseObjectPropertyOrEnd() : parseObjectPropertyRequired())
-            : parseObjectEnd());
-    case JTokenKind::PropertyToken:
-        return kind == JTokenKind::PropertyNameToken
-            ? ignoreWhitespace(parsePropertyValue()) // Name parsed, needs value
-            : ignoreWhitespace(parseOptionalComma());// Value parsed, but have not created the property
-    case JTokenKind::ArrayElementToken:
-        return ignoreWhitespace(parseOptionalComma());
-    case JTokenKind::ArrayToken:
-        if (!AllowTrailingCommas && hadTrailingComma){
-            nodeKinds.push(JTokenKind::ArrayElementToken);
-        }
-        return ignoreWhitespace(hadTrailingComma 
-            ? (AllowTrailingCommas ? parseTokenOrArrayEnd() : beginToken())
-            : parseArrayEnd());
+    else if (bound && !(record == expected)) {
+        disagree("bind holds different values than the dom");
     }
-    std::cerr << "Could not continue after node " << nodeKinds.top() << std::endl;
-    return ignoreInput();
-}
 
-ParseState *parseOptionalComma(){
-    return new ParseState([](char c) { 
-        // either way, we're pushing the property, we're just getting the trailing comma first
-        if (c == ',')
-        {
-            token << c;
-            emit(TokenKind::Comma);
-            return pushNode();
-        }
-        tokens.push(nullptr);// ,
-        return unpeek(pushNode(), c);
-    });
+    delete root;
+    result.Calibration = std::min(result.Calibration, timeMode([&]() { calibrate(data, length); }, repeat));
+    return result.Disagreement.empty();
 }
 
-ParseState *parseTokenOrArrayEnd(){
-    return new ParseState([](char c) { 
-        if (c == ']')
-        {
-            token << c;
-            emit(TokenKind::RightSQBracket);
-            return pushNode();
-        }
-        nodeKinds.push(JTokenKind::ArrayElementToken);
-        return unpeek(beginToken(), c);
-    });
+// mkdir -p
+static bool makeDirectories(const std::string &directory)
+{
+    for (auto slash = directory.find('/', 1); slash != std::string::npos; slash = directory.find('/', slash + 1)) {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+    }
+    return mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST;
 }
 
-ParseState *parseArrayEnd(){
-    return new ParseState([](char c) { 
-        if (c == ']')
-        {
-            token << c;
-            emit(TokenKind::RightSQBracket);
-            return pushNode();
-        }
-        return expectedInput("']' or ','", c);
-    });
+bool recordInput(const std::string &directory, const char *data, size_t length)
+{
+    if (!makeDirectories(directory)) return false;
+    char name[16];
+    std::snprintf(name, sizeof(name), "%08x.json", hashKey(data, length, 0));
+    auto path = directory + "/" + name;
+    if (access(path.c_str(), F_OK) == 0) return true;
+    std::ofstream out(path, std::ios::binary);
+    out.write(data, length);
+    return (bool)out;
 }
 
-ParseState *eof(){
-    return new ParseState([](char c) { return error("Expected end of file"); });
-}
+// Baseline lines are "<file> <mode> <ratio>", the mode's time over the
+// calibration loop's in the same round. Timings on a busy machine scatter
+// by a third from round to round and between runs, even for the best round,
+// so the checked ratio is the best over the rounds and the recorded one the
+// lower quartile, which a single lucky round doesn't set. Recording
+// replaces the lines for filename; checking also fails when a mode has no
+// line to compare with. Modes quicker than BASELINE_MIN_MICROSECONDS are
+// neither recorded nor checked. Failures are only reported when report is set.
+static bool checkBaseline(const std::string &baseline, const std::string &filename, bool record, const std::vector<DifferentialResult> &rounds, bool report)
+{
+    std::vector<std::tuple<std::string, std::string, double>> entries;
+    std::ifstream in(baseline);
+    if (!in && !record) {
+        if (report) std::cerr << "Could not read the baseline '" << baseline << "', make baseline records one" << std::endl;
+        return false;
+    }
+    std::string file, mode;
+    double ratio;
+    while (in >> file >> mode >> ratio) {
+        if (!record || file != filename) entries.push_back(std::make_tuple(file, mode, ratio));
+    }
+    in.close();
 
-ParseState *error(std::string message){
-    std::cerr << message << std::endl;
-    return ignoreInput();
-}
+    // Every round times the same modes in the same order
+    std::vector<std::pair<const char *, std::vector<double>>> ratios;
+    for (auto round = rounds.begin(); round != rounds.end(); ++round) {
+        auto calibration = (double)std::max(round->Calibration.count(), (long)1);
+        for (size_t i = 0; i < round->Timings.size(); i++) {
+            if (i == ratios.size()) ratios.push_back(std::make_pair(round->Timings[i].Mode, std::vector<double>()));
+            ratios[i].second.push_back(round->Timings[i].Time.count() / calibration);
+        }
+    }
+    auto timed = [&](size_t mode) {
+        return rounds.front().Timings[mode].Time >= std::chrono::microseconds(BASELINE_MIN_MICROSECONDS);
+    };
 
-ParseState *unexpectedInput(char c){
-    std::cerr << "Unexpected Character '" << c << "'" << std::endl;
-    return ignoreInput();
-}
+    if (record) {
+        for (size_t i = 0; i < ratios.size(); i++) {
+            if (!timed(i)) continue;
+            auto &values = ratios[i].second;
+            std::nth_element(values.begin(), values.begin() + values.size() / 4, values.end());
+            entries.push_back(std::make_tuple(filename, std::string(ratios[i].first), values[values.size() / 4]));
+        }
+        auto slash = baseline.rfind('/');
+        if (slash != std::string::npos && slash > 0) makeDirectories(baseline.substr(0, slash));
+        std::ofstream out(baseline);
+        for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
+            out << std::get<0>(*iter) << " " << std::get<1>(*iter) << " " << std::get<2>(*iter) << std::endl;
+        }
+        if (!out) {
+            std::cerr << "Could not write the baseline '" << baseline << "': " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        std::cout << "Recorded the baseline for '" << filename << "' in " << baseline << std::endl;
+        return true;
+    }
 
-ParseState *expectedInput(std::string expectedMessage, char c){
-    std::cerr << "Expected input " << expectedMessage << " got '" << c << "'" << std::endl;
-    return ignoreInput();
+    bool regressed = false;
+    for (size_t i = 0; i < ratios.size(); i++) {
+        double measured = *std::min_element(ratios[i].second.begin(), ratios[i].second.end());
+        auto found = std::find_if(entries.begin(), entries.end(), [&](const std::tuple<std::string, std::string, double> &e) {
+            return std::get<0>(e) == filename && std::get<1>(e) == ratios[i].first;
+        });
+        if (found == entries.end()) {
+            if (!timed(i)) continue;
+            if (report) std::cerr << filename << ": " << ratios[i].first << " has no baseline in " << baseline << ", make baseline records one" << std::endl;
+            regressed = true;
+        }
+        else if (measured > std::get<2>(*found) * (100 + BASELINE_TOLERANCE_PERCENT) / 100) {
+            if (report) std::cerr
+                << filename << ": " << ratios[i].first << " takes " << measured
+                << "x the calibration loop, the baseline is " << std::get<2>(*found) << "x" << std::endl;
+            regressed = true;
+        }
+    }
+    return !regressed;
 }
 
-ParseState *ignoreInput(){
-    return new ParseState([](char c) { return ignoreInput(); });
-}
+int differentialFile(InputPipeline &input, const std::string &filename, bool bench, const std::string &corpus, long slowNsPerByte, const std::string &baseline, bool recordBaseline)
+{
+    std::string source;
+    const char *chunk;
+    size_t length;
+    while (input.Next(chunk, length)) {
+        source.append(chunk, length);
+        input.Release();
+    }
+    if (input.Error() != nullptr) {
+        std::cerr << "Could not read '" << filename << "': " << input.Error() << std::endl;
+        return 1;
+    }
 
-ParseState *ignoreWhitespace(ParseState *state){
-    return new ParseState([=](char c) {
-        if (std::isspace(c))
-        {
-            return ignoreWhitespace(state);
+    DifferentialResult result;
+    bool agreed = checkModes(source.data(), source.length(), bench || !baseline.empty(), result);
+    if (!agreed) {
+        std::cerr << filename << ": " << result.Disagreement << std::endl;
+    }
+    else {
+        std::cout << filename << ": " << source.length() << " bytes, " << (result.Accepted ? "valid" : "invalid") << ", all modes agree" << std::endl;
+    }
+
+    bool slow = false;
+    for (auto iter = result.Timings.begin(); iter != result.Timings.end(); ++iter) {
+        auto nsPerByte = (double)iter->Time.count() / std::max(source.length(), (size_t)1);
+        slow = slow || (source.length() >= SLOW_MIN_BYTES && nsPerByte > slowNsPerByte);
+        if (bench) {
+            std::cout
+                << "  " << iter->Mode << ": " << nsPerByte << " ns/byte, "
+                << (double)iter->Time.count() / std::max(result.Calibration.count(), (long)1) << "x calibration" << std::endl;
         }
-        return unpeek(state, c);
-    });
-}
+    }
+    if (!corpus.empty() && (!agreed || slow)) {
+        if (recordInput(corpus, source.data(), source.length())) {
+            std::cout << "Recorded '" << filename << "' in " << corpus << std::endl;
+        }
+        else {
+            std::cerr << "Could not record '" << filename << "' in " << corpus << ": " << std::strerror(errno) << std::endl;
+        }
+    }
 
-ParseState *unpeek(ParseState * state, char c)
-{
-    auto next = (*state)(c);
-    delete state;
-    return next;
+    if (agreed && !baseline.empty()) {
+        // Slow stretches on a busy machine can outlast a set of rounds, so a
+        // failed check takes more of them, the best of all of them counting;
+        // a recording takes as many rounds as a check can
+        std::vector<DifferentialResult> rounds(1, result);
+        for (int retry = recordBaseline ? BASELINE_RETRIES : 0; ; retry++) {
+            while (rounds.size() < BASELINE_ROUNDS * (retry + 1)) {
+                rounds.emplace_back();
+                checkModes(source.data(), source.length(), true, rounds.back());
+            }
+            bool last = retry == BASELINE_RETRIES;
+            if (checkBaseline(baseline, filename, recordBaseline, rounds, last)) break;
+            if (last) return 1;
+        }
+    }
+    return agreed ? 0 : 1;
 }
 
-ParseState *readLiteral(std::string sequence, TokenKind literalKind)
+#ifdef JSONPARSE_FUZZ
+// libFuzzer entry point, see the fuzz target in the Makefile. Disagreements
+// abort, slow inputs are recorded in $JSONPARSE_CORPUS (fuzz/corpus by default).
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
-    return new ParseState([=](char c) {
-        if (c == sequence[0])
-        {
-            token << c;
-            if (sequence.length() == 1)
-            {
-                emit(literalKind);
-                return pushNode();
-            }
-            return readLiteral(sequence.substr(1), literalKind);
+    DifferentialResult result;
+    if (!checkModes((const char *)data, size, false, result)) {
+        std::cerr << "Modes disagree: " << result.Disagreement << std::endl;
+        std::abort();
+    }
+    for (auto iter = result.Timings.begin(); iter != result.Timings.end() && size >= SLOW_MIN_BYTES; ++iter) {
+        if (iter->Time.count() / size > SLOW_NS_PER_BYTE) {
+            auto corpus = std::getenv("JSONPARSE_CORPUS");
+            recordInput(corpus != nullptr ? corpus : "fuzz/corpus", (const char *)data, size);
+            break;
         }
-        return unexpectedInput(c);
-    });
-}
\ No newline at end of file
+    }
+    return 0;
+}
+#endif